@@ -0,0 +1,60 @@
+#ifndef BRICK_MAP_H
+#define BRICK_MAP_H
+
+#include <deque>
+#include <vector>
+#include <stdint.h>
+#include "descriptor_arena.h"
+
+struct gridCell
+{
+  gridCell() : active(false), empty(false), descriptor(descriptor_arena::null_handle), spilled(-1) {}
+
+  // cell_type_t contents;
+  bool active;
+  /// Set when the brick was all Dmax as it left the active volume. Such bricks are not encoded
+  bool empty;
+  /// Handle of the brick's descriptor in the grid's descriptor_arena, null_handle if it is not resident
+  descriptor_arena::handle descriptor;
+  /// Record of the brick's descriptor in the memory-mapped brick store, -1 if it has not been spilled
+  int spilled;
+};
+
+/// Maps integer brick coordinates to the gridCell holding the brick's descriptor. Open addressing with linear probing
+/// over a power-of-two table that doubles when it is half full. Cells come from a pool that only grows, so pointers
+/// returned by find() and insert() stay valid for the lifetime of the map.
+class brick_map
+{
+  public:
+
+  brick_map(size_t capacity = 4096);
+
+  /// Returns the cell at x,y,z or NULL if nothing was ever stored there
+  gridCell* find(int x, int y, int z);
+
+  /// Returns the cell at x,y,z, creating an empty one if needed
+  gridCell& insert(int x, int y, int z);
+
+  /// Number of cells in the map
+  size_t size(void) const {return cells_.size();}
+
+  void clear(void);
+
+  protected:
+
+  struct slot
+  {
+    int key[3];
+    int cell; // index into cells_, -1 for an unused slot
+  };
+
+  size_t hash(int x, int y, int z) const;
+  size_t probe(int x, int y, int z) const;
+  void grow(void);
+
+  std::vector<slot> slots_;
+  std::deque<gridCell> cells_;
+  size_t mask_;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef DESCRIPTOR_ARENA_H
+#define DESCRIPTOR_ARENA_H
+
+#include <vector>
+#include <thrust/device_vector.h>
+
+/// All brick descriptors in one contiguous device allocation. Descriptors are addressed by handle, which is simply the
+/// descriptor's index in the arena, so handles survive growth while raw pointers from data() do not. Released handles
+/// go on a free list and are handed out again before the arena grows.
+class descriptor_arena
+{
+  public:
+
+  typedef int handle;
+  static const handle null_handle = -1;
+
+  descriptor_arena(int descriptor_size = 0, int slab_descriptors = 1024);
+
+  /// Sets the number of floats per descriptor, discarding any descriptors already stored
+  void reset(int descriptor_size);
+
+  /// Returns a handle to an unused descriptor. Its contents are undefined until written
+  handle allocate(void);
+
+  /// Returns the descriptor to the free list
+  void release(handle h);
+
+  /// Device pointer to the first float of the descriptor. Invalidated by the next allocate() that grows the arena
+  float* data(handle h) {return thrust::raw_pointer_cast(&storage_[size_t(h)*descriptor_size_]);}
+
+  /// The whole arena, capacity()*descriptor_size() floats, for batched passes over all descriptors
+  thrust::device_vector<float>& storage(void) {return storage_;}
+
+  int descriptor_size(void) const {return descriptor_size_;}
+  int capacity(void) const {return capacity_;}
+
+  /// Number of descriptors currently handed out
+  int size(void) const {return capacity_ - int(free_.size());}
+
+  protected:
+
+  void grow(void);
+
+  thrust::device_vector<float> storage_;
+  std::vector<handle> free_;
+  int descriptor_size_;
+  int slab_descriptors_;
+  int capacity_;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef DESCRIPTOR_STORE_H
+#define DESCRIPTOR_STORE_H
+
+#include <string>
+#include <vector>
+#include "brick_map.h"
+
+/// Owns the descriptors of the cells of a brick_map. Up to resident_limit descriptors are kept in a descriptor_arena on
+/// the device; beyond that the least recently used one is spilled to a memory-mapped file and faulted back in the next
+/// time it is fetched. Without a limit every descriptor stays resident and no file is created.
+class descriptor_store
+{
+  public:
+
+  descriptor_store();
+  ~descriptor_store();
+
+  /// Discards all descriptors and sets the record size in floats. A positive resident_limit spills to a scratch file
+  /// at path, which is unlinked as soon as it is opened. If it cannot be created every descriptor stays resident
+  void reset(int record_size, int resident_limit = 0, const std::string &path = std::string());
+
+  /// True if the cell has a descriptor, resident or spilled
+  bool stored(const gridCell &cell) const
+  {return cell.descriptor != descriptor_arena::null_handle || cell.spilled >= 0;}
+
+  /// Device pointer to the cell's descriptor for reading, faulting it in if it was spilled. NULL if there is none
+  const float* fetch(gridCell &cell);
+
+  /// Device pointer to record_size floats that will hold the cell's descriptor. The previous contents are undefined
+  float* acquire(gridCell &cell);
+
+  /// Drops the cell's descriptor, wherever it is
+  void release(gridCell &cell);
+
+  int resident(void) const {return arena_.size();}
+  int spilled(void) const {return file_spilled_;}
+
+  /// Fetches of resident descriptors, fetches that had to fault in from the file, and descriptors written to the file
+  long hits(void) const {return hits_;}
+  long misses(void) const {return misses_;}
+  long spills(void) const {return spills_;}
+  /// Total time spent faulting descriptors back in, in seconds
+  double page_in_time(void) const {return page_in_time_;}
+
+  protected:
+
+  descriptor_arena arena_;
+  int resident_limit_;
+
+  /// Least recently used order over arena handles. owner_ maps each handle back to its cell so it can be spilled
+  std::vector<gridCell*> owner_;
+  std::vector<int> lru_prev_, lru_next_;
+  int lru_head_, lru_tail_;
+  void lru_push(int h);
+  void lru_remove(int h);
+
+  /// Takes an arena handle for cell, spilling the least recently used descriptor first if the arena is full
+  int take_handle(gridCell &cell);
+  void spill(int h);
+
+  int fd_;
+  float* file_;
+  int file_records_;
+  int file_spilled_;
+  std::vector<int> file_free_;
+  int take_record(void);
+  void free_record(gridCell &cell);
+  void close_file(void);
+
+  long hits_, misses_, spills_;
+  double page_in_time_;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef FUSION_KERNELS_H
+#define FUSION_KERNELS_H
+
+/// Everything the vectorized fusion kernels need to know about the current frame
+struct fusion_frame
+{
+  /// Row-major depth image, NaN wherever a voxel may not be fused from that pixel
+  const float* depth;
+  int width, height;
+  float fx, fy, cx, cy;
+  /// Voxels with a camera depth below min_z are skipped
+  float min_z;
+  float Dmin, Dmax, Wmax, Wslope;
+  /// A voxel whose weight is Wmax and whose distance is within tolerance of the measurement is stable
+  float tolerance;
+};
+
+/// What fuse_row found in a row, a combination of these flags
+enum fusion_result
+{
+  /// Some voxel's stored distance changed, or would change
+  FUSION_CHANGED = 1,
+  /// Some voxel was fused at all
+  FUSION_OBSERVED = 2,
+  /// Some fused voxel was not stable, see fusion_frame::tolerance
+  FUSION_UNSTABLE = 4
+};
+
+/// Instruction sets that have a vectorized fusion kernel
+enum fusion_isa { FUSION_SCALAR = 0, FUSION_AVX2, FUSION_AVX512 };
+
+/// The best instruction set supported by the CPU, detected at run time
+fusion_isa detect_fusion_isa(void);
+
+/// Fuses a row of 16 consecutive voxels with the kernel for isa, which must not be FUSION_SCALAR. origin holds the
+/// camera coordinates of the first voxel and step the camera-space offset from one voxel to the next. d and w are
+/// the distances and weights of the row. If they are NULL, the row is taken to hold Dmax with zero weight. Nothing is
+/// written if they are NULL or update is false. Returns the fusion_result flags of what was, or would have been, fused
+unsigned fuse_row(fusion_isa isa, const fusion_frame &frame, const float origin[3], const float step[3], float* d, float* w,
+                  bool update = true);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef NORMAL_EQUATIONS_H
+#define NORMAL_EQUATIONS_H
+
+#include <vector>
+#include <Eigen/Core>
+
+/// Accumulates the Gauss-Newton system A = sum w*J'J, g = sum w*J'r of a 6 parameter problem in double precision.
+/// Only the 21 entries of the upper triangle of A are stored, row by row, so that each row of an update is one
+/// contiguous multiply-add of a scalar with the tail of J
+class normal_equations
+{
+  public:
+
+  normal_equations() {clear();}
+
+  void clear(void)
+  {
+    for(int n = 0; n < 21; ++n) a_[n] = 0.0;
+    for(int n = 0; n < 6; ++n) g_[n] = 0.0;
+    error_ = 0.0;
+    count_ = 0;
+  }
+
+  /// Adds a residual with jacobian J and robust weight w
+  void add(const double J[6], double w, double residual)
+  {
+    double* row = a_;
+    for(int i = 0; i < 6; ++i)
+    {
+      const double wJ = w*J[i];
+      for(int j = i; j < 6; ++j) row[j-i] += wJ*J[j];
+      row += 6-i;
+      g_[i] += wJ*residual;
+    }
+    error_ += residual*residual;
+    ++count_;
+  }
+
+  void merge(const normal_equations &other)
+  {
+    for(int n = 0; n < 21; ++n) a_[n] += other.a_[n];
+    for(int n = 0; n < 6; ++n) g_[n] += other.g_[n];
+    error_ += other.error_;
+    count_ += other.count_;
+  }
+
+  /// Merges partial[1..count) into partial[0] in a pairwise tree whose shape depends only on count, so the sum
+  /// does not depend on which threads filled which partials
+  static void reduce(std::vector<normal_equations> &partial, size_t count)
+  {
+    for(size_t stride = 1; stride < count; stride *= 2)
+      for(size_t i = 0; i + stride < count; i += 2*stride)
+        partial[i].merge(partial[i+stride]);
+  }
+
+  /// The full symmetric A and g
+  void expand(Eigen::Matrix<double,6,6> &A, Eigen::Matrix<double,6,1> &g) const
+  {
+    const double* row = a_;
+    for(int i = 0; i < 6; ++i)
+    {
+      for(int j = i; j < 6; ++j) A(i,j) = A(j,i) = row[j-i];
+      row += 6-i;
+      g(i) = g_[i];
+    }
+  }
+
+  /// Number of residuals added and the sum of their squares, unweighted
+  long count(void) const {return count_;}
+  double error(void) const {return error_;}
+
+  protected:
+
+  double a_[21];
+  double g_[6];
+  double error_;
+  long count_;
+};
+
+#endif
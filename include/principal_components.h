@@ -19,10 +19,24 @@ class principal_components
   void load_dictionary(std::string &filename);
   void load_mean(std::string &filename);
   void encode(thrust::device_vector<float> &input, thrust::device_vector<float> &output);
+  /// Encodes into descriptor_size() floats of device memory, e.g. a slot in a descriptor_arena
+  void encode(thrust::device_vector<float> &input, float* output);
   void compare_gold(thrust::host_vector<float> &input , thrust::host_vector<float> &output);
 
   void compare(thrust::host_vector<float> &input , thrust::host_vector<float> &output);
   void decode(thrust::device_vector<float> &input, thrust::device_vector<float> &output);
+  /// Decodes descriptor_size() floats of device memory
+  void decode(const float* input, thrust::device_vector<float> &output);
+
+  /// Size in floats of a quantized descriptor: a scale and an offset followed by descriptor_size() int8 coefficients
+  int quantized_size(void) {return 2 + (reduced_dim+3)/4;}
+  /// Encodes into quantized_size() floats of device memory, each coefficient stored as int8 with a per-descriptor
+  /// scale and offset
+  void encode_quantized(thrust::device_vector<float> &input, float* output);
+  /// Dequantizes the coefficients and decodes them
+  void decode_quantized(const float* input, thrust::device_vector<float> &output);
+  /// RMS reconstruction error of the input through float and through quantized descriptors
+  void compare_quantized(thrust::host_vector<float> &input, float &rms_float, float &rms_quantized);
   bool describes_empty(thrust::device_vector<float> &input, const float threshold = 1e-6);
 
   void get_word_for_empty(thrust::host_vector<float> &output){output = word_for_empty;}
@@ -3,8 +3,13 @@
 
 #include <boost/thread/mutex.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <stdint.h>
+#include <type_traits>
 #include <Eigen/Core>
 #include <unsupported/Eigen/MatrixFunctions>
 
@@ -16,6 +21,10 @@
 #include "principal_components.h"
 #include "vector_functions.h"
 #include "neural_network.h"
+#include "brick_map.h"
+#include "descriptor_store.h"
+#include "fusion_kernels.h"
+#include "normal_equations.h"
 
 #define EIGEN_USE_NEW_STDVECTOR
 
@@ -34,13 +43,6 @@ typedef Eigen::Matrix<double,6,1> Vector6d;
   Eigen::Matrix4d GetMat4_rodrigues_smallangle(const Vector6d &xi);
 
 
-struct gridCell
-{
-  // cell_type_t contents;
-  bool active;
-  thrust::device_vector<float> descriptor;
-};
-
 class SDF_Parameters
 {
 public:
@@ -51,10 +53,13 @@ public:
   int raycast_steps;
   int image_height;
   int image_width;
+  /// Intrinsics of images calibration_width pixels wide, scaled to image_width by SDFTracker. The defaults are for a
+  /// 640 pixel wide Kinect. Set calibration_width to 0 if the intrinsics are already for image_width
   double fx;
   double fy;
   double cx;
   double cy;
+  int calibration_width;
   double Wmax;
   double resolution;
   double Dmax;
@@ -64,12 +69,106 @@ public:
   double regularization;
   double min_parameter_update;
   double min_pose_change;
+  /// Allocate bricks of the active volume on first touch, see hyperGrid. This bounds resident memory, not the size of
+  /// the volume: address space for every brick is still reserved and the per-brick tables stay dense
+  bool sparse_volume;
+  bool elide_empty_bricks;
+  bool quantized_descriptors;
+  int resident_descriptors;
+  std::string brick_store_path;
+  bool vectorized_fusion;
+  bool surface_band_fusion;
+  int freeze_frames;
+  double freeze_tolerance;
+  int keyframe_interval;
+  double keyframe_translation;
+  double keyframe_rotation;
+  double keyframe_depth_change;
+  bool keyframe_averaging;
+  double keyframe_stationary_translation;
+  double keyframe_stationary_rotation;
+  double tracking_budget;
+  double motion_decay;
+  double motion_max_translation;
+  double motion_max_rotation;
+  double pyramid_edge_threshold;
   std::string render_window;
 
   SDF_Parameters();
   virtual ~SDF_Parameters();
 };
 
+/// Storage policies for the active volume of a hyperGrid. A policy defines how distances and weights are stored
+/// and converts them to and from floats. Policies are built from the truncation limits and maximum weight of their grid.
+
+/// Distances and weights as floats, 8 bytes per voxel
+struct float_voxel
+{
+  typedef float distance_t;
+  typedef float weight_t;
+
+  float_voxel(float Dmin, float Dmax, float Wmax) : Wmax_(Wmax) {}
+
+  /// Whether rows of the active volume can be fused with the kernels in fusion_kernels.h, through fuse_row
+  static const bool has_row_kernel = true;
+
+  float distance(distance_t d) const {return d;}
+  float weight(weight_t w) const {return w;}
+  bool saturated(weight_t w) const {return w >= Wmax_;}
+  bool truncated(distance_t d, double threshold) const {return d > threshold;}
+  void set(distance_t &d, weight_t &w, float D, float W) const {d = D; w = W;}
+
+  /// Weighted running average of the stored distance with D, weights saturate at Wmax
+  void fuse(distance_t &d, weight_t &w, float D, float W) const
+  {
+    d = (d * w + D * W) / (w + W);
+    w = std::min(w + W, Wmax_);
+  }
+
+  unsigned fuse_row(fusion_isa isa, const fusion_frame &frame, const float origin[3], const float step[3], distance_t* d, weight_t* w,
+                    bool update) const
+  {return ::fuse_row(isa, frame, origin, step, d, w, update);}
+
+  float Wmax_;
+};
+
+/// Distances as 16 bit integers spanning [Dmin, Dmax] and weights as 8 bit integers spanning [0, Wmax], 3 bytes per voxel
+struct quantized_voxel
+{
+  typedef int16_t distance_t;
+  typedef uint8_t weight_t;
+
+  quantized_voxel(float Dmin, float Dmax, float Wmax)
+  : Dmax_(Dmax), d_step_((Dmax-Dmin)/65535.0f), d_scale_(65535.0f/(Dmax-Dmin)), w_step_(Wmax/255.0f), w_scale_(255.0f/Wmax) {}
+
+  /// Quantized voxels are always fused one at a time and have no fuse_row
+  static const bool has_row_kernel = false;
+
+  //distances are counted down from Dmax so that the truncation value is exact
+  float distance(distance_t d) const {return Dmax_ - float(32767 - d)*d_step_;}
+  float weight(weight_t w) const {return float(w)*w_step_;}
+  bool saturated(weight_t w) const {return w == 255;}
+  bool truncated(distance_t d, double threshold) const {return distance(d) > threshold;}
+
+  void set(distance_t &d, weight_t &w, float D, float W) const
+  {
+    float q = 32767.0f - (Dmax_ - D)*d_scale_;
+    d = distance_t(lrintf(std::max(-32768.0f, std::min(32767.0f, q))));
+    w = weight_t(lrintf(std::max(0.0f, std::min(255.0f, W*w_scale_))));
+  }
+
+  void fuse(distance_t &d, weight_t &w, float D, float W) const
+  {
+    float d_f = distance(d);
+    float w_f = weight(w);
+    set(d, w, (d_f * w_f + D * W) / (w_f + W), w_f + W);
+  }
+
+  float Dmax_, d_step_, d_scale_, w_step_, w_scale_;
+};
+
+/// The active volume type is chosen at compile time, define TSDF_QUANTIZED to use quantized_voxel
+template<class V>
 class hyperGrid
 {
 
@@ -77,15 +176,41 @@ public:
 
   principal_components PCA;
   neural_network NN;
-  /// Checks the validity of the gradient of the SDF at the current point
+  /// Checks the validity of the gradient of the SDF at the current point, a lookup in gradientMask_
   bool ValidGradient(const Eigen::Vector4d &location);
 
+  /// ValidGradient, SDF and SDFGradient with a step size of 1 in one query that reads the 32 voxels they share once.
+  /// Returns the validity of the gradient. value and gradient are only set when it is true
+  bool SDFAndGradient(const Eigen::Vector4d &location, double &value, Eigen::Vector3d &gradient);
+
   hyperGrid();
 
-  hyperGrid(uint X, uint Y, uint Z, uint x, uint y, uint z, float Wmax, float Dmax, float Dmin, float cellSize)
-  : hyper_XSize_(X), hyper_YSize_(Y), hyper_ZSize_(Z), active_XSize_(x), active_YSize_(y), active_ZSize_(z), Wmax_(Wmax), Dmax_(Dmax), Dmin_(Dmin), cellSize_(cellSize)
+  typedef typename V::distance_t distance_t;
+  typedef typename V::weight_t weight_t;
+
+  /// If sparse is set, bricks of the active volume are only allocated once fusion writes a distance below Dmax into them.
+  /// The pool still reserves address space for every brick up front and is never grown, and brickTable_, mortonBricks_
+  /// and the other per-brick tables stay dense, so only the resident size follows the allocated bricks.
+  /// If elide_empty is set, bricks that leave the active volume as free space are tagged instead of encoded.
+  /// If quantize_descriptors is set, descriptors of paged out bricks are stored as int8 with a per-brick scale and offset.
+  /// If resident_descriptors is positive, at most that many descriptors are kept in memory and the least recently used
+  /// ones are spilled to a memory-mapped file at store_path.
+  /// If vector_fusion is set and the storage policy and CPU allow it, FuseDepth uses the AVX2 or AVX-512 kernels.
+  /// If band_fusion is set, FuseDepth walks the rays of the depth image through the truncation band instead of visiting voxels
+  /// If freeze_frames is positive, voxel-centric fusion stops updating bricks that stayed stable for that many frames
+  /// in a row, see brickStable_. freeze_tolerance is how far in meters a measurement may stray and still count as stable
+  hyperGrid(uint x, uint y, uint z, float Wmax, float Dmax, float Dmin, float cellSize, bool sparse = false, bool elide_empty = true,
+            bool quantize_descriptors = false, int resident_descriptors = 0, const std::string &store_path = std::string(),
+            bool vector_fusion = true, bool band_fusion = false, int freeze_frames = 0, float freeze_tolerance = 0.01f)
+  : Wmax_(Wmax), Dmax_(Dmax), Dmin_(Dmin), cellSize_(cellSize), active_XSize_(x), active_YSize_(y), active_ZSize_(z),
+    codec_(Dmin, Dmax, Wmax), sparse_(sparse), elide_empty_(elide_empty), quantize_descriptors_(quantize_descriptors),
+    resident_limit_(resident_descriptors), store_path_(store_path), brickTable_(NULL), activeDistance_(NULL), activeWeight_(NULL)
   {
     for (int i = 0; i < 3; ++i) block_shift_[i] =0;
+    fusion_isa_ = (vector_fusion && V::has_row_kernel) ? detect_fusion_isa() : FUSION_SCALAR;
+    band_fusion_ = band_fusion;
+    freeze_frames_ = std::max(0, std::min(255, freeze_frames));
+    freeze_tolerance_ = freeze_tolerance;
     this->Init();
   };
 
@@ -115,9 +240,31 @@ public:
 
   void Clear();
 
+  /// Number of bricks of the active volume that currently hold data
+  int allocatedBricks(void);
+
+  /// Prints the RMS reconstruction error, in meters, of the non-empty bricks in the active volume when encoded as
+  /// float and as quantized descriptors
+  void ReportDescriptorError(void);
+
+  /// Prints how many descriptors are resident and spilled, the fetch hit rate and the mean page-in latency
+  void ReportPaging(void);
+
   void FuseDepth(Eigen::Matrix4d &worldToCam, cimg_library::CImg<float> *depthImage, bool** validityMask, float fx, float fy, float cx, float cy);
+
+  /// Fuses a sequence of frames with known poses, with the same result as calling FuseDepth on each in order. Every
+  /// brick is visited once and applies all frames that see it while it is in cache, which suits offline replay
+  void FuseDepthBatch(const std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > &worldToCam,
+                      const std::vector<cimg_library::CImg<float>*> &depthImages, const std::vector<bool**> &validityMasks,
+                      float fx, float fy, float cx, float cy);
   int block_shift_[3];
 
+  /// Number of bricks that were integrated by the last call to FuseDepth
+  int visibleBricks(void);
+
+  /// Number of bricks of the active volume that fusion currently skips
+  int frozenBricks(void);
+
 protected:
 
 
@@ -128,14 +275,158 @@ protected:
   double Dmin_;
   float cellSize_;
   static const uint hyperCellSize_ = 16;
-  uint hyper_XSize_, hyper_YSize_, hyper_ZSize_;
   uint active_XSize_, active_YSize_, active_ZSize_;
 
-  float &activeVolume(int x, int y, int z);
-  float &activeVolume_w(int x, int y, int z);
-
-  float*** activeVolume_;
-  gridCell*** hGrid_;
+  /// Converts between stored voxels and floats
+  V codec_;
+
+  float activeVolume(int x, int y, int z);
+  float activeVolume_w(int x, int y, int z);
+
+  /// Ring-buffer addressing. ring_shift_ is block_shift_ in voxels, wrapped into the active volume. When all active
+  /// sizes are powers of two, wrapping is a mask with ring_mask_ instead of a call to mod()
+  int ring_shift_[3];
+  int ring_mask_[3];
+  bool ring_pow2_;
+  void updateRing(void);
+  int wrap(int v, int dim);
+
+  /// Returns a pointer to voxel I,J,K if the extent^3 stencil starting there lies inside a single brick, NULL otherwise.
+  /// Neighbours are then found at fixed offsets given by stride_x_, stride_y_ and stride_z_
+  const distance_t* stencil(int I, int J, int K, int extent);
+  static const int stride_x_ = 1;
+  static const int stride_y_ = stride_x_*hyperCellSize_;
+  static const int stride_z_ = stride_y_*hyperCellSize_;
+
+  static const uint brickVoxels_ = hyperCellSize_*hyperCellSize_*hyperCellSize_;
+  static const int brickRows_ = hyperCellSize_*hyperCellSize_;
+
+  /// Offset of the voxel at x,y,z in both planes, already wrapped into the ring buffer
+  size_t voxelOffset(int x, int y, int z);
+
+  /// Index into brickTable_ of the brick holding x,y,z, already wrapped into the ring buffer
+  size_t brickIndex(int x, int y, int z);
+
+  /// Offset of the voxel at x,y,z within its brick, already wrapped into the ring buffer
+  size_t localIndex(int x, int y, int z);
+
+  /// Index into brickTable_ of the brick at i,j,k, in brick coordinates relative to the active region
+  size_t activeBrick(int i, int j, int k);
+
+  /// Bricks live in a pool shared by both planes. brickTable_ maps each brick of the ring buffer to its slot in the pool.
+  /// Slot 0 holds a brick of Dmax with zero weight that is never written, unallocated bricks point to it so that reads
+  /// need no special case. In dense mode every brick has its own slot from the start. In sparse mode the pool is sized
+  /// for every brick as well, only untouched pages of it stay non-resident
+  bool sparse_;
+  bool elide_empty_;
+  bool quantize_descriptors_;
+  int resident_limit_;
+  std::string store_path_;
+  int* brickTable_;
+  std::vector<int> freeBricks_;
+
+  /// Set by fusion when it changes a distance in the brick, indexed like brickTable_. A clean brick still matches what
+  /// its cell holds, a descriptor, an empty tag or no cell at all, so paging it out needs no encoding. Bytes rather than
+  /// bits so that fusion threads can set them without touching their neighbours
+  std::vector<char> brickDirty_;
+
+  /// Takes a slot from the pool and resets it to Dmax, returns 0 if the pool is exhausted
+  int allocateBrick(void);
+  void releaseBrick(int slot);
+
+  /// Collects into visibleBricks_ the bricks that may hold voxels at camera depths in [min_z, max_z] projecting inside
+  /// the image. Bricks are indexed as (bz*BY + by)*BX + bx in brick coordinates relative to the active region and
+  /// listed in the order of mortonBricks_. Called by every thread of a parallel region, or outside of one
+  void CullBricks(const Eigen::Matrix4d &worldToCam, double min_z, double max_z, int width, int height, float fx, float fy, float cx, float cy);
+  std::vector<int> visibleBricks_;
+  std::vector<char> brickVisible_;
+  std::vector<int> mortonBricks_;
+
+  /// Fuses the voxels of one brick of visibleBricks_, unless it is frozen and agrees with the frame. Voxels at camera
+  /// depths below min_z are skipped
+  void FuseBrick(int brick, const Eigen::Matrix4d &worldToCam, const cimg_library::CImg<float> &depthImage, bool** validityMask,
+                 const fusion_frame &frame, const float step[3], double min_z);
+
+  /// Fuses every stride-th row of the brick along y and z, or only checks them if update is false. Returns the
+  /// fusion_result flags of the rows
+  unsigned FuseRows(int brick, const Eigen::Matrix4d &worldToCam, const cimg_library::CImg<float> &depthImage, bool** validityMask,
+                    const fusion_frame &frame, const float step[3], double min_z, int stride, bool update);
+
+  /// Fuses the x row of a brick starting at x0,y,z with the row kernel of the storage policy codec and adds its
+  /// fusion_result flags to result. Selected at compile time on P::has_row_kernel, so fuse_row is only ever
+  /// instantiated for policies that have one; without it the row is left to the scalar loop and false is returned
+  template<class P>
+  typename std::enable_if<P::has_row_kernel, bool>::type
+  FuseRowKernel(const P &codec, int x0, int y, int z, const Eigen::Matrix4d &worldToCam, const fusion_frame &frame,
+                const float step[3], bool update, unsigned &result);
+  template<class P>
+  typename std::enable_if<!P::has_row_kernel, bool>::type
+  FuseRowKernel(const P &codec, int x0, int y, int z, const Eigen::Matrix4d &worldToCam, const fusion_frame &frame,
+                const float step[3], bool update, unsigned &result) {return false;}
+
+  /// Frames in a row, up to freeze_frames_, in which every voxel fused into the brick was at full weight and within
+  /// freeze_tolerance_ of the measurement, indexed like brickTable_. Frames that fuse nothing leave it alone. Once it
+  /// reaches freeze_frames_ the brick is frozen: fusion only checks every probe_stride_-th row against the frame and
+  /// thaws the brick, resetting the count, when one of them is not stable. Band fusion ignores it
+  std::vector<unsigned char> brickStable_;
+  int freeze_frames_;
+  float freeze_tolerance_;
+  static const int probe_stride_ = 4;
+
+  /// Bit volumes indexed like brickTable_ times 256, with one word per x row of a brick. nearMask_ has a bit set for
+  /// every voxel below Dmax, gradientMask_ for every voxel I,J,K from which the stencil of ValidGradient only reaches
+  /// voxels below Dmax. Fusion and paging mark the bricks they write in brickTouched_, and UpdateMasks then brings
+  /// both masks up to date for those bricks and for the bricks whose stencils reach into them
+  std::vector<uint16_t> nearMask_;
+  std::vector<uint16_t> gradientMask_;
+  std::vector<char> brickTouched_;
+  void UpdateMasks(void);
+
+  /// Ray-driven fusion. Each valid pixel walks its ray through the voxels within [depth-Dmax, depth-Dmin] and fuses
+  /// those that project back onto it. Every voxel has a single such pixel, so threads never write the same voxel and
+  /// the band gets the same values as voxel-centric fusion. Free space in front of the band is not carved, and where
+  /// a pixel covers more than a voxel the voxels its ray misses are left alone
+  void FuseBand(const Eigen::Matrix4d &worldToCam, const cimg_library::CImg<float> &depthImage, bool** validityMask,
+                const fusion_frame &frame, double min_z);
+  bool band_fusion_;
+
+  /// Kernel used by FuseDepth, FUSION_SCALAR for the per-voxel loop. The vector kernels read fusableDepth_, the depth
+  /// image of each frame being fused with NaN wherever the validity mask forbids fusing from a pixel
+  fusion_isa fusion_isa_;
+  std::vector<std::vector<float> > fusableDepth_;
+
+  /// Depth images that FuseDepthBatch fuses in one pass over the bricks may take up to this many bytes together
+  static const size_t batch_cache_bytes = 2 << 20;
+
+  /// Fills in the parts of a fusion_frame that only depend on the pose and camera, and the step between voxels of a row
+  fusion_frame MakeFrame(const Eigen::Matrix4d &worldToCam, int width, int height, float fx, float fy, float cx, float cy, float step[3]);
+
+  /// Sets max_depth to the deepest valid measurement and, unless fusable is NULL, writes the depths that may be fused
+  /// into it. Called by every thread of a parallel region, or outside of one
+  void ScanDepth(const cimg_library::CImg<float> &depthImage, bool** validityMask, float* fusable, float &max_depth);
+
+  /// Returns the slot of brick, allocating it first if needed. Safe to call from fusion threads
+  int touchBrick(size_t brick);
+
+  /// True if no voxel of the brick is below Dmax
+  bool emptyBrick(const distance_t* brick_d);
+
+  /// Writes the distances of the brick, normalized to [0,1] as the codec expects them
+  void normalizeBrick(const distance_t* brick_d, thrust::host_vector<float> &voxels);
+
+  /// Encodes the brick at i,j,k into the cell ENC, unless it is clean, and refills it from the descriptor of the cell DEC,
+  /// if there is one. The descriptor stays with the cell while the brick is active
+  void pageBrick(int i, int j, int k, int DEC_X, int DEC_Y, int DEC_Z, int ENC_X, int ENC_Y, int ENC_Z);
+
+  /// The active volume is stored as two planes, distances and weights, so that tracking and rendering only stream
+  /// distances. Each plane is a single pool of hyperCellSize_^3 bricks with x varying fastest within each brick,
+  /// the same ordering used for PCA descriptors
+  distance_t* activeDistance_;
+  weight_t* activeWeight_;
+  /// Descriptors of bricks that have left the active volume, keyed by brick position. The map is unbounded
+  brick_map hGrid_;
+  /// Storage for the descriptors referenced by hGrid_, resident or spilled to disk
+  descriptor_store descriptors_;
 
 
   gridCell *Floor_;
@@ -144,6 +435,30 @@ protected:
 
 };
 
+#ifdef TSDF_QUANTIZED
+typedef hyperGrid<quantized_voxel> sdfGrid;
+#else
+typedef hyperGrid<float_voxel> sdfGrid;
+#endif
+
+/// What one pose estimate did, see SDFTracker::EstimatePoseFromDepth
+struct tracking_report
+{
+  /// Gauss-Newton iterations run over all levels, and the finest pyramid level reached, 0 being full resolution
+  int iterations;
+  int finest_level;
+  /// Root mean square SDF value at the points of the last iteration, and how many points that was
+  double residual;
+  long points;
+  /// Wall time spent, and whether the deadline cut iterations or levels short
+  double seconds;
+  bool deadline_hit;
+  /// Whether the estimate started from the motion model's prediction, and whether it then had to start over from
+  /// zero. iterations counts both runs
+  bool predicted;
+  bool fell_back;
+};
+
 class SDFTracker
 {
   protected:
@@ -161,11 +476,73 @@ class SDFTracker
   boost::mutex depth_mutex_;
   std::string camera_name_;
 
-  hyperGrid* myGrid_;
+  sdfGrid* myGrid_;
   bool** validityMask_;
   bool first_frame_;
   bool quit_;
   SDF_Parameters parameters_;
+
+  /// Fusion gating. A frame is a keyframe if the camera moved more than keyframe_translation or keyframe_rotation
+  /// since the last fused frame, or if the mean depth change over pixels valid in both exceeds keyframe_depth_change.
+  /// Other frames are skipped, up to keyframe_interval-1 in a row. With keyframe_averaging the skipped frames are
+  /// averaged per pixel into averageDepth_ and fused as one frame at the pose of the last of them. Only frames within
+  /// the stricter keyframe_stationary_translation and keyframe_stationary_rotation of averageTransformation_, the pose
+  /// of the first frame in the average, join it; any other skipped frame fuses the average and starts a new one
+  Eigen::Matrix4d fusedTransformation_;
+  Eigen::Matrix4d pendingTransformation_;
+  Eigen::Matrix4d averageTransformation_;
+  int averaged_;
+  cimg_library::CImg<float> fusedDepth_;
+  cimg_library::CImg<float> depthSum_;
+  cimg_library::CImg<float> depthCount_;
+  cimg_library::CImg<float> averageDepth_;
+  bool** averageMask_;
+  int skipped_;
+  unsigned long int fused_count_;
+  bool Keyframe(void);
+  void AccumulateDepth(void);
+  void FusePending(void);
+
+  /// Depth pyramid for coarse-to-fine tracking, built by UpdateDepth with all levels back to back in pyramid_, full
+  /// resolution first. Each level halves the one before: a pixel averages the inverse depths of the valid pixels of its
+  /// 2x2 block that lie within pyramid_edge_threshold, relative, of the nearest of them, so depth edges are not
+  /// blurred and planes stay planar. Invalid pixels are NaN. pyramidIntrinsics_ holds fx, fy, cx, cy of each level
+  static const int pyramid_levels_ = 3;
+  std::vector<float> pyramid_;
+  size_t pyramidOffset_[pyramid_levels_];
+  int pyramidWidth_[pyramid_levels_];
+  int pyramidHeight_[pyramid_levels_];
+  double pyramidIntrinsics_[pyramid_levels_][4];
+  void BuildPyramid(void);
+
+  /// The valid pixels of each pyramid level back-projected to camera space by UpdateDepth, with one array per
+  /// coordinate. The points of row r are [rowStart[r], rowStart[r+1]). rayX_ and rayY_ hold (col-cx)/fx and
+  /// (row-cy)/fy of each level, so a point is its depth times (rayX_, rayY_, 1)
+  struct point_cloud
+  {
+    std::vector<float> x, y, z;
+    std::vector<int> rowStart;
+  };
+  point_cloud levelPoints_[pyramid_levels_];
+  std::vector<float> rayX_[pyramid_levels_];
+  std::vector<float> rayY_[pyramid_levels_];
+  void BuildPoints(void);
+
+  /// Seconds per point of the last Gauss-Newton iteration, which the next deadline-bound estimate plans with
+  double pointCost_;
+  tracking_report trackingReport_;
+  /// One partial system per row of the finest level, sized in Init and cleared by each Gauss-Newton iteration
+  std::vector<normal_equations> partial_;
+
+  /// Constant velocity motion model. velocity_ is the last pose increment, and the next estimate starts from
+  /// motion_decay times it, or from zero if that translates by more than motion_max_translation metres or rotates by more
+  /// than motion_max_rotation radians. If the points found from the prediction drop below half of lastPoints_ of the
+  /// finest level it reached, the count of the last estimate that ended on that level, it starts over from zero
+  Vector6d velocity_;
+  long lastPoints_[pyramid_levels_];
+  Vector6d GaussNewton(const Vector6d &initial, const std::chrono::high_resolution_clock::time_point &deadline,
+                       tracking_report &report);
+
   // functions
   virtual void Init(SDF_Parameters &parameters);
   virtual void DeleteGrids(void);
@@ -178,12 +555,27 @@ class SDFTracker
   /// Sets the current depth map
   virtual void UpdateDepth(const cimg_library::CImg<float> &depth);
 
-  /// Estimates the incremental pose change vector from the current pose, relative to the current depth map
+  /// Estimates the incremental pose change vector from the current pose, relative to the current depth map. Unless
+  /// tracking_budget is 0 it returns within about that many seconds of the call, see the overload below
   virtual Vector6d EstimatePoseFromDepth(void);
 
-  // /// Fuses the current depth map into the TSDF volume, the current depth map is set using UpdateDepth
+  /// Estimates the pose change as above but by deadline. The solver times its iterations and, before each one,
+  /// predicts its cost from the measured cost per point. An iteration that would overrun is not started, and a level
+  /// is left early when there would not be time left for an iteration on the next finer one. Returns the estimate so
+  /// far and describes the run in report
+  virtual Vector6d EstimatePoseFromDepth(const std::chrono::high_resolution_clock::time_point &deadline, tracking_report &report);
+
+  /// The report of the last call to EstimatePoseFromDepth
+  const tracking_report& LastTrackingReport(void){return trackingReport_;};
+
+  /// Fuses the current depth map into the TSDF volume, the current depth map is set using UpdateDepth. Unless
+  /// keyframe_interval is 1 the frame may be skipped or averaged with others, see SDF_Parameters
   virtual void FuseDepth(void);
 
+  /// Number of frames passed to FuseDepth and number of integrations into the volume that they led to
+  unsigned long int FrameCount(void){return frame_count_;};
+  unsigned long int FusedCount(void){return fused_count_;};
+
   // /// Fuses the current depth map into the TSDF volume, the current depth map is set using UpdateDepth
   virtual void checkTranslation(int tolerance);
 
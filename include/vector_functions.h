@@ -61,6 +61,33 @@ struct subtract
 };
 
 
+/// Maps a value to a signed 8 bit code, code = round((x-offset)/scale) clamped to [-127,127]
+template <typename T>
+struct quantize
+{
+    const T offset, inv_scale;
+    quantize(T _offset, T _inv_scale) : offset(_offset), inv_scale(_inv_scale) {}
+
+    __host__ __device__
+    signed char operator()(const T& x) const {
+        T q = (x-offset)*inv_scale;
+        q = (q > 127) ? 127 : ((q < -127) ? -127 : q);
+        return (signed char)((q < 0) ? q-T(0.5) : q+T(0.5));
+    }
+};
+
+template <typename T>
+struct dequantize
+{
+    const T scale, offset;
+    dequantize(T _scale, T _offset) : scale(_scale), offset(_offset) {}
+
+    __host__ __device__
+    T operator()(const signed char& q) const {
+        return offset + scale*T(q);
+    }
+};
+
 template <typename T>
 struct square
 {
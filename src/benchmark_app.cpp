@@ -0,0 +1,293 @@
+#include <sdf_tracker.h>
+
+#include <omp.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Renders the depth seen from camToWorld of a synthetic room: a floor at y = -0.5, a wall at z = 1.2 and a sphere of
+// radius 0.2 at (0.2, 0, 0.9). Pixels without a surface within 4m are NaN
+static void RenderScene(cimg_library::CImg<float> &depth, bool** validityMask, const Eigen::Matrix4d &camToWorld, const SDF_Parameters &p)
+{
+  const Eigen::Vector3d o = (camToWorld*Eigen::Vector4d(0,0,0,1)).head<3>();
+  const Eigen::Vector3d sphere(0.2, 0.0, 0.9);
+
+  for(int i = 0; i < p.image_height; ++i)
+  for(int j = 0; j < p.image_width; ++j)
+  {
+    //the ray has unit depth in the camera frame, so the distance along it is the depth
+    const Eigen::Vector3d v = (camToWorld*To3D(i, j, 1.0, p.fx, p.fy, p.cx, p.cy)).head<3>() - o;
+    double t = std::numeric_limits<double>::max();
+    if(v(2) > 1e-9) t = std::min(t, (1.2 - o(2))/v(2));
+    if(v(1) < -1e-9) t = std::min(t, (-0.5 - o(1))/v(1));
+
+    const Eigen::Vector3d oc = o - sphere;
+    const double a = v.dot(v), b = 2*oc.dot(v), c = oc.dot(oc) - 0.04;
+    const double disc = b*b - 4*a*c;
+    if(disc > 0 && (-b - sqrt(disc))/(2*a) > 0) t = std::min(t, (-b - sqrt(disc))/(2*a));
+
+    validityMask[i][j] = (t > 0 && t < 4.0);
+    depth(j,i) = validityMask[i][j] ? float(t) : std::numeric_limits<float>::quiet_NaN();
+  }
+}
+
+// A synthetic sequence of frames and their true poses. The camera backs away from the scene while panning, so the
+// visible part of the volume changes every frame
+struct sequence
+{
+  std::vector<cimg_library::CImg<float> > depth;
+  std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > worldToCam;
+  std::vector<bool**> validityMask;
+  int rows;
+
+  sequence(const SDF_Parameters &p, int frames)
+  : depth(frames, cimg_library::CImg<float>(p.image_width, p.image_height)), worldToCam(frames), validityMask(frames),
+    rows(p.image_height)
+  {
+    for(int f = 0; f < frames; ++f)
+    {
+      Eigen::Matrix4d camToWorld = Eigen::Matrix4d::Identity();
+      camToWorld.block<3,3>(0,0) = Eigen::AngleAxisd(0.01*f + 0.003, Eigen::Vector3d(0.3, 1.0, 0.1).normalized()).toRotationMatrix();
+      camToWorld(0,3) = 0.004*f + 0.0013;
+      camToWorld(1,3) = 0.0007;
+      camToWorld(2,3) = 0.002*f - 0.3;
+      worldToCam[f] = camToWorld.inverse();
+
+      validityMask[f] = new bool*[p.image_height];
+      for(int i = 0; i < p.image_height; ++i) validityMask[f][i] = new bool[p.image_width];
+      RenderScene(depth[f], validityMask[f], camToWorld, p);
+    }
+  }
+
+  ~sequence()
+  {
+    for(size_t f = 0; f < validityMask.size(); ++f)
+    {
+      for(int i = 0; i < rows; ++i) delete[] validityMask[f][i];
+      delete[] validityMask[f];
+    }
+  }
+
+  int frames(void) const {return int(depth.size());}
+
+  void Fuse(sdfGrid &grid, int f, const SDF_Parameters &p)
+  {
+    grid.FuseDepth(worldToCam[f], &depth[f], validityMask[f], p.fx, p.fy, p.cx, p.cy);
+  }
+
+  // The points pose estimation queries, frame f back-projected with its true pose
+  void Points(int f, const SDF_Parameters &p, std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d> > &points)
+  {
+    const Eigen::Matrix4d camToWorld = worldToCam[f].inverse();
+    points.clear();
+    for(int i = 0; i < p.image_height; ++i)
+    for(int j = 0; j < p.image_width; ++j)
+      if(validityMask[f][i][j])
+        points.push_back(camToWorld*To3D(i, j, depth[f](j,i), p.fx, p.fy, p.cx, p.cy));
+  }
+};
+
+static double Milliseconds(const std::chrono::high_resolution_clock::time_point &tic)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tic).count();
+}
+
+// Fuses the sequence into a fresh volume for each thread count, one frame at a time and then as one batch, and reports
+// the time per frame. Then times the SDF queries of pose estimation at the points of the last frame
+static void ScalingBenchmark(SDF_Parameters &myParameters, int max_threads)
+{
+  const int frames = 30;
+  sequence scene(myParameters, frames);
+
+  std::vector<cimg_library::CImg<float>*> batchDepth;
+  for(int f = 1; f < frames; ++f) batchDepth.push_back(&scene.depth[f]);
+  const std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > batchPoses(scene.worldToCam.begin()+1, scene.worldToCam.end());
+  const std::vector<bool**> batchMasks(scene.validityMask.begin()+1, scene.validityMask.end());
+
+  std::cout << myParameters.XSize << "^3 volume, " << myParameters.image_width << "x" << myParameters.image_height << " depth, "
+            << omp_get_num_procs() << " processors" << std::endl;
+
+  double single = 0;
+  for(int threads = 1; threads <= max_threads; threads *= 2)
+  {
+    omp_set_num_threads(threads);
+    sdfGrid grid(myParameters.XSize, myParameters.YSize, myParameters.ZSize, myParameters.Wmax, myParameters.Dmax,
+                 myParameters.Dmin, myParameters.resolution, myParameters.sparse_volume);
+
+    //the first frame warms up the thread pool and the volume pages
+    scene.Fuse(grid, 0, myParameters);
+
+    std::chrono::high_resolution_clock::time_point tic = std::chrono::high_resolution_clock::now();
+    for(int f = 1; f < frames; ++f) scene.Fuse(grid, f, myParameters);
+    const double ms = Milliseconds(tic)/(frames-1);
+    if(threads == 1) single = ms;
+
+    sdfGrid batchGrid(myParameters.XSize, myParameters.YSize, myParameters.ZSize, myParameters.Wmax, myParameters.Dmax,
+                      myParameters.Dmin, myParameters.resolution, myParameters.sparse_volume);
+    scene.Fuse(batchGrid, 0, myParameters);
+
+    tic = std::chrono::high_resolution_clock::now();
+    batchGrid.FuseDepthBatch(batchPoses, batchDepth, batchMasks, myParameters.fx, myParameters.fy, myParameters.cx, myParameters.cy);
+    const double batch_ms = Milliseconds(tic)/(frames-1);
+
+    printf("%3d threads: fuse %7.2f ms/frame, speedup %5.2f, efficiency %3.0f%%, batched %7.2f ms/frame\n",
+           threads, ms, single/ms, 100*single/(ms*threads), batch_ms);
+  }
+
+  omp_set_num_threads(1);
+  sdfGrid grid(myParameters.XSize, myParameters.YSize, myParameters.ZSize, myParameters.Wmax, myParameters.Dmax,
+               myParameters.Dmin, myParameters.resolution, myParameters.sparse_volume);
+  for(int f = 0; f < frames; ++f) scene.Fuse(grid, f, myParameters);
+
+  std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d> > points;
+  scene.Points(frames-1, myParameters, points);
+
+  const int repeats = 5;
+  double separate_sum = 0, fused_sum = 0, max_error = 0;
+  int separate_valid = 0, fused_valid = 0;
+
+  std::chrono::high_resolution_clock::time_point tic = std::chrono::high_resolution_clock::now();
+  for(int r = 0; r < repeats; ++r)
+  for(size_t p = 0; p < points.size(); ++p)
+  {
+    if(!grid.ValidGradient(points[p])) continue;
+    separate_sum += grid.SDF(points[p]) + grid.SDFGradient(points[p],1,0) + grid.SDFGradient(points[p],1,1) + grid.SDFGradient(points[p],1,2);
+    ++separate_valid;
+  }
+  const double separate_ns = 1e6*Milliseconds(tic)/(repeats*points.size());
+
+  tic = std::chrono::high_resolution_clock::now();
+  for(int r = 0; r < repeats; ++r)
+  for(size_t p = 0; p < points.size(); ++p)
+  {
+    double value;
+    Eigen::Vector3d gradient;
+    if(!grid.SDFAndGradient(points[p], value, gradient)) continue;
+    fused_sum += value + gradient.sum();
+    ++fused_valid;
+  }
+  const double fused_ns = 1e6*Milliseconds(tic)/(repeats*points.size());
+
+  for(size_t p = 0; p < points.size(); ++p)
+  {
+    double value;
+    Eigen::Vector3d gradient;
+    if(!grid.SDFAndGradient(points[p], value, gradient)) continue;
+    max_error = std::max(max_error, std::fabs(value - grid.SDF(points[p])));
+    for(int d = 0; d < 3; ++d) max_error = std::max(max_error, std::fabs(gradient(d) - grid.SDFGradient(points[p],1,d)));
+  }
+
+  printf("%d points, %d with valid gradients: separate queries %6.1f ns/point, fused %6.1f ns/point, speedup %4.2f\n",
+         int(points.size()), separate_valid/repeats, separate_ns, fused_ns, separate_ns/fused_ns);
+  printf("fused valid %d, largest difference %g, checksums %f %f\n", fused_valid/repeats, max_error, separate_sum, fused_sum);
+}
+
+// Single thread cost of the active volume layout at 128^3 and 256^3: construction, FuseDepth per frame and SDF() per
+// query at the points of the last frame. The checksum sums the queried distances, so layouts can be compared for
+// identical results as well as speed
+static void VolumeBenchmark(SDF_Parameters &myParameters)
+{
+  const int frames = 30, repeats = 5;
+  sequence scene(myParameters, frames);
+  std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d> > points;
+  scene.Points(frames-1, myParameters, points);
+  omp_set_num_threads(1);
+
+  for(int size = 128; size <= 256; size *= 2)
+  {
+    std::chrono::high_resolution_clock::time_point tic = std::chrono::high_resolution_clock::now();
+    sdfGrid grid(size, size, size, myParameters.Wmax, myParameters.Dmax, myParameters.Dmin, myParameters.resolution,
+                 myParameters.sparse_volume);
+    const double construct_ms = Milliseconds(tic);
+
+    scene.Fuse(grid, 0, myParameters);
+    tic = std::chrono::high_resolution_clock::now();
+    for(int f = 1; f < frames; ++f) scene.Fuse(grid, f, myParameters);
+    const double fuse_ms = Milliseconds(tic)/(frames-1);
+
+    double checksum = 0;
+    tic = std::chrono::high_resolution_clock::now();
+    for(int r = 0; r < repeats; ++r)
+    for(size_t p = 0; p < points.size(); ++p) checksum += grid.SDF(points[p]);
+    const double sdf_ns = 1e6*Milliseconds(tic)/(repeats*points.size());
+
+    printf("%d^3: construct %7.1f ms, FuseDepth %7.1f ms/frame, SDF() %6.1f ns/query, checksum %f\n",
+           size, construct_ms, fuse_ms, sdf_ns, checksum/repeats);
+  }
+}
+
+// Cost of the brick_map that holds paged out bricks, on its own and inside shiftActiveGrid. The map alone inserts and
+// looks up a 40^3 block of brick keys. Shifts into new space insert a slab of cells per call, round trips over space
+// the volume has already visited only look them up
+static void ShiftBenchmark(SDF_Parameters &myParameters)
+{
+  const int R = 40, repeats = 10;
+  brick_map map;
+  std::chrono::high_resolution_clock::time_point tic = std::chrono::high_resolution_clock::now();
+  for(int i = 0; i < R; ++i) for(int j = 0; j < R; ++j) for(int k = 0; k < R; ++k) map.insert(i-R/2, j, k+1000);
+  const double insert_ns = 1e6*Milliseconds(tic)/(R*R*R);
+
+  long hits = 0, misses = 0;
+  tic = std::chrono::high_resolution_clock::now();
+  for(int r = 0; r < repeats; ++r)
+  for(int i = 0; i < R; ++i) for(int j = 0; j < R; ++j) for(int k = 0; k < R; ++k) hits += map.find(i-R/2, j, k+1000) != NULL;
+  const double hit_ns = 1e6*Milliseconds(tic)/(repeats*R*R*R);
+
+  tic = std::chrono::high_resolution_clock::now();
+  for(int r = 0; r < repeats; ++r)
+  for(int i = 0; i < R; ++i) for(int j = 0; j < R; ++j) for(int k = 0; k < R; ++k) misses += map.find(i+5000, j, k) == NULL;
+  const double miss_ns = 1e6*Milliseconds(tic)/(repeats*R*R*R);
+
+  printf("brick_map, %d bricks: insert %5.1f ns, find hit %5.1f ns, find miss %5.1f ns (%ld hits, %ld misses)\n",
+         int(map.size()), insert_ns, hit_ns, miss_ns, hits/repeats, misses/repeats);
+
+  //a fused volume, so bricks that leave it carry data
+  const int frames = 10, steps = 16;
+  sequence scene(myParameters, frames);
+  sdfGrid grid(myParameters.XSize, myParameters.YSize, myParameters.ZSize, myParameters.Wmax, myParameters.Dmax,
+               myParameters.Dmin, myParameters.resolution, myParameters.sparse_volume);
+  for(int f = 0; f < frames; ++f) scene.Fuse(grid, f, myParameters);
+
+  tic = std::chrono::high_resolution_clock::now();
+  for(int s = 0; s < steps; ++s) grid.shiftActiveGrid(1, 0, 0);
+  const double new_ms = Milliseconds(tic)/steps;
+
+  tic = std::chrono::high_resolution_clock::now();
+  for(int r = 0; r < steps/4; ++r)
+  {
+    grid.shiftActiveGrid(-1, 0, 0); grid.shiftActiveGrid(0, 1, 0); grid.shiftActiveGrid(1, 0, 0); grid.shiftActiveGrid(0, -1, 0);
+  }
+  const double visited_ms = Milliseconds(tic)/(4*(steps/4));
+
+  printf("%d^3 shifts: into new space %6.2f ms, over mapped space %6.2f ms\n", myParameters.XSize, new_ms, visited_ms);
+}
+
+// sdf_benchmark_app [size [width [threads]]] runs the thread scaling benchmark, sdf_benchmark_app volume [width] the
+// active volume benchmark and sdf_benchmark_app shift [size [width]] the shift benchmark
+int main(int argc, char* argv[])
+{
+  const std::string mode = (argc > 1 && (std::string(argv[1]) == "volume" || std::string(argv[1]) == "shift")) ? argv[1] : "";
+  //the shift benchmark takes the size after its name
+  const int next = (mode == "shift") ? 2 : 1;
+
+  SDF_Parameters myParameters;
+  myParameters.interactive_mode = false;
+  myParameters.resolution = 0.02;
+  myParameters.Dmax = 0.1;
+  myParameters.Dmin = -0.1;
+
+  const int size = (argc > next && mode != "volume") ? atoi(argv[next]) : (mode == "shift" ? 128 : 256);
+  myParameters.XSize = myParameters.YSize = myParameters.ZSize = size;
+  myParameters.image_width = (argc > next+1) ? atoi(argv[next+1]) : (mode.empty() ? 640 : 320);
+  myParameters.image_height = myParameters.image_width*3/4;
+  myParameters.fx = myParameters.fy = 520.0*myParameters.image_width/640;
+  myParameters.cx = (myParameters.image_width-1)/2.0;
+  myParameters.cy = (myParameters.image_height-1)/2.0;
+
+  if(mode == "volume") VolumeBenchmark(myParameters);
+  else if(mode == "shift") ShiftBenchmark(myParameters);
+  else ScalingBenchmark(myParameters, (argc > 3) ? atoi(argv[3]) : 64);
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include "brick_map.h"
+
+brick_map::brick_map(size_t capacity)
+{
+  size_t size = 16;
+  while(size < capacity) size <<= 1;
+
+  slot empty = {{0,0,0}, -1};
+  slots_.assign(size, empty);
+  mask_ = size-1;
+}
+
+size_t brick_map::hash(int x, int y, int z) const
+{
+  //large primes from Teschner et al., "Optimized Spatial Hashing for Collision Detection of Deformable Objects"
+  return size_t((uint32_t(x)*73856093u) ^ (uint32_t(y)*19349663u) ^ (uint32_t(z)*83492791u));
+}
+
+size_t brick_map::probe(int x, int y, int z) const
+{
+  size_t idx = hash(x,y,z) & mask_;
+  while(slots_[idx].cell >= 0)
+  {
+    const int* key = slots_[idx].key;
+    if(key[0] == x && key[1] == y && key[2] == z) break;
+    idx = (idx+1) & mask_;
+  }
+  return idx;
+}
+
+gridCell* brick_map::find(int x, int y, int z)
+{
+  const slot &s = slots_[probe(x,y,z)];
+  return (s.cell >= 0) ? &cells_[s.cell] : NULL;
+}
+
+gridCell& brick_map::insert(int x, int y, int z)
+{
+  size_t idx = probe(x,y,z);
+  if(slots_[idx].cell >= 0) return cells_[slots_[idx].cell];
+
+  if(2*(cells_.size()+1) > slots_.size())
+  {
+    grow();
+    idx = probe(x,y,z);
+  }
+
+  cells_.push_back(gridCell());
+  slot &s = slots_[idx];
+  s.key[0] = x; s.key[1] = y; s.key[2] = z;
+  s.cell = int(cells_.size())-1;
+  return cells_.back();
+}
+
+void brick_map::grow(void)
+{
+  std::vector<slot> old_slots;
+  old_slots.swap(slots_);
+
+  slot empty = {{0,0,0}, -1};
+  slots_.assign(old_slots.size()*2, empty);
+  mask_ = slots_.size()-1;
+
+  for (size_t i = 0; i < old_slots.size(); ++i)
+  {
+    if(old_slots[i].cell < 0) continue;
+    const int* key = old_slots[i].key;
+    slots_[probe(key[0], key[1], key[2])] = old_slots[i];
+  }
+}
+
+void brick_map::clear(void)
+{
+  slot empty = {{0,0,0}, -1};
+  slots_.assign(slots_.size(), empty);
+  cells_.clear();
+}
@@ -0,0 +1,41 @@
+#include "descriptor_arena.h"
+
+descriptor_arena::descriptor_arena(int descriptor_size, int slab_descriptors)
+: descriptor_size_(descriptor_size), slab_descriptors_(slab_descriptors), capacity_(0)
+{}
+
+void descriptor_arena::reset(int descriptor_size)
+{
+  descriptor_size_ = descriptor_size;
+  capacity_ = 0;
+  free_.clear();
+  storage_.clear();
+}
+
+descriptor_arena::handle descriptor_arena::allocate(void)
+{
+  if(free_.empty()) grow();
+
+  handle h = free_.back();
+  free_.pop_back();
+  return h;
+}
+
+void descriptor_arena::release(handle h)
+{
+  if(h != null_handle) free_.push_back(h);
+}
+
+void descriptor_arena::grow(void)
+{
+  //grow by whole slabs, at least doubling, so that the copy made by resize() is amortized over many allocations
+  const int added = (capacity_ > slab_descriptors_) ? capacity_ : slab_descriptors_;
+
+  storage_.resize(size_t(capacity_ + added)*descriptor_size_);
+
+  //hand out the lowest handles first
+  for (int h = capacity_ + added - 1; h >= capacity_; --h)
+    free_.push_back(h);
+
+  capacity_ += added;
+}
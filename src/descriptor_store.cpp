@@ -0,0 +1,193 @@
+#include "descriptor_store.h"
+
+#include <chrono>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <thrust/copy.h>
+#include <thrust/device_ptr.h>
+
+descriptor_store::descriptor_store()
+: resident_limit_(0), lru_head_(-1), lru_tail_(-1), fd_(-1), file_(NULL), file_records_(0), file_spilled_(0),
+  hits_(0), misses_(0), spills_(0), page_in_time_(0)
+{}
+
+descriptor_store::~descriptor_store()
+{
+  close_file();
+}
+
+void descriptor_store::reset(int record_size, int resident_limit, const std::string &path)
+{
+  close_file();
+  arena_.reset(record_size);
+  owner_.clear();
+  lru_prev_.clear();
+  lru_next_.clear();
+  lru_head_ = lru_tail_ = -1;
+  hits_ = misses_ = spills_ = 0;
+  page_in_time_ = 0;
+
+  resident_limit_ = 0;
+  if(resident_limit <= 0) return;
+
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if(fd_ < 0)
+  {
+    std::cerr << "Could not create brick store " << path << ", keeping all descriptors resident." << std::endl;
+    return;
+  }
+  ::unlink(path.c_str());
+  resident_limit_ = resident_limit;
+}
+
+void descriptor_store::close_file(void)
+{
+  if(file_ != NULL) munmap(file_, size_t(file_records_)*arena_.descriptor_size()*sizeof(float));
+  if(fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+  file_ = NULL;
+  file_records_ = 0;
+  file_spilled_ = 0;
+  file_free_.clear();
+}
+
+const float* descriptor_store::fetch(gridCell &cell)
+{
+  if(cell.descriptor != descriptor_arena::null_handle)
+  {
+    ++hits_;
+    lru_remove(cell.descriptor);
+    lru_push(cell.descriptor);
+    return arena_.data(cell.descriptor);
+  }
+  if(cell.spilled < 0) return NULL;
+
+  ++misses_;
+  std::chrono::high_resolution_clock::time_point tic = std::chrono::high_resolution_clock::now();
+
+  const int h = take_handle(cell);
+  const int record = cell.spilled;
+  const float* src = file_ + size_t(record)*arena_.descriptor_size();
+  thrust::copy(src, src + arena_.descriptor_size(), thrust::device_ptr<float>(arena_.data(h)));
+  free_record(cell);
+
+  std::chrono::high_resolution_clock::time_point toc = std::chrono::high_resolution_clock::now();
+  page_in_time_ += std::chrono::duration<double>(toc - tic).count();
+
+  return arena_.data(h);
+}
+
+float* descriptor_store::acquire(gridCell &cell)
+{
+  if(cell.descriptor != descriptor_arena::null_handle)
+  {
+    lru_remove(cell.descriptor);
+    lru_push(cell.descriptor);
+    return arena_.data(cell.descriptor);
+  }
+
+  //the old contents are about to be overwritten, so a spilled copy is simply dropped instead of faulted in
+  free_record(cell);
+  return arena_.data(take_handle(cell));
+}
+
+void descriptor_store::release(gridCell &cell)
+{
+  if(cell.descriptor != descriptor_arena::null_handle)
+  {
+    lru_remove(cell.descriptor);
+    owner_[cell.descriptor] = NULL;
+    arena_.release(cell.descriptor);
+    cell.descriptor = descriptor_arena::null_handle;
+  }
+  free_record(cell);
+}
+
+void descriptor_store::free_record(gridCell &cell)
+{
+  if(cell.spilled < 0) return;
+  file_free_.push_back(cell.spilled);
+  cell.spilled = -1;
+  --file_spilled_;
+}
+
+int descriptor_store::take_handle(gridCell &cell)
+{
+  if(resident_limit_ > 0 && arena_.size() >= resident_limit_ && lru_tail_ >= 0) spill(lru_tail_);
+
+  const int h = arena_.allocate();
+  if(int(owner_.size()) < arena_.capacity())
+  {
+    owner_.resize(arena_.capacity(), NULL);
+    lru_prev_.resize(arena_.capacity(), -1);
+    lru_next_.resize(arena_.capacity(), -1);
+  }
+  owner_[h] = &cell;
+  cell.descriptor = h;
+  lru_push(h);
+  return h;
+}
+
+void descriptor_store::spill(int h)
+{
+  gridCell* cell = owner_[h];
+  const int record = take_record();
+  if(record < 0) return;
+
+  float* dst = file_ + size_t(record)*arena_.descriptor_size();
+  thrust::device_ptr<float> src(arena_.data(h));
+  thrust::copy(src, src + arena_.descriptor_size(), dst);
+  ++spills_;
+  ++file_spilled_;
+
+  lru_remove(h);
+  owner_[h] = NULL;
+  arena_.release(h);
+  cell->descriptor = descriptor_arena::null_handle;
+  cell->spilled = record;
+}
+
+int descriptor_store::take_record(void)
+{
+  if(file_free_.empty())
+  {
+    //the file grows by doubling, the mapping follows it
+    const size_t record_bytes = size_t(arena_.descriptor_size())*sizeof(float);
+    const int records = (file_records_ > 0) ? 2*file_records_ : 1024;
+    if(ftruncate(fd_, off_t(records*record_bytes)) != 0) return -1;
+
+    void* map = (file_ == NULL) ? mmap(NULL, records*record_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0)
+                                : mremap(file_, file_records_*record_bytes, records*record_bytes, MREMAP_MAYMOVE);
+    if(map == MAP_FAILED) return -1;
+
+    file_ = static_cast<float*>(map);
+    for (int r = records - 1; r >= file_records_; --r)
+      file_free_.push_back(r);
+    file_records_ = records;
+  }
+
+  const int record = file_free_.back();
+  file_free_.pop_back();
+  return record;
+}
+
+void descriptor_store::lru_push(int h)
+{
+  //most recently used at the head, eviction from the tail
+  lru_prev_[h] = -1;
+  lru_next_[h] = lru_head_;
+  if(lru_head_ >= 0) lru_prev_[lru_head_] = h;
+  lru_head_ = h;
+  if(lru_tail_ < 0) lru_tail_ = h;
+}
+
+void descriptor_store::lru_remove(int h)
+{
+  if(lru_prev_[h] >= 0) lru_next_[lru_prev_[h]] = lru_next_[h];
+  else lru_head_ = lru_next_[h];
+  if(lru_next_[h] >= 0) lru_prev_[lru_next_[h]] = lru_prev_[h];
+  else lru_tail_ = lru_prev_[h];
+  lru_prev_[h] = lru_next_[h] = -1;
+}
@@ -0,0 +1,145 @@
+#include "fusion_kernels.h"
+
+#include <limits>
+#include <immintrin.h>
+
+//Both kernels mirror the scalar loop in hyperGrid::FuseRows, in single precision. Camera coordinates are affine along
+//the row, so each lane is origin + lane*step. The products and sums are kept separate, not fused, so that rounding
+//matches the scalar path as closely as single precision allows.
+
+__attribute__((target("avx2")))
+static unsigned fuse_row_avx2(const fusion_frame &f, const float origin[3], const float step[3], float* d, float* w, bool update)
+{
+  const __m256 nan = _mm256_set1_ps(std::numeric_limits<float>::quiet_NaN());
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256i zero_i = _mm256_setzero_si256();
+  const __m256i width_i = _mm256_set1_epi32(f.width);
+  const __m256i last_col = _mm256_set1_epi32(f.width-1);
+  const __m256i last_row = _mm256_set1_epi32(f.height-1);
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+  unsigned result = 0;
+  for(int first = 0; first < 16; first += 8)
+  {
+    const __m256 lane = _mm256_setr_ps(first, first+1, first+2, first+3, first+4, first+5, first+6, first+7);
+    const __m256 px = _mm256_add_ps(_mm256_set1_ps(origin[0]), _mm256_mul_ps(lane, _mm256_set1_ps(step[0])));
+    const __m256 py = _mm256_add_ps(_mm256_set1_ps(origin[1]), _mm256_mul_ps(lane, _mm256_set1_ps(step[1])));
+    const __m256 pz = _mm256_add_ps(_mm256_set1_ps(origin[2]), _mm256_mul_ps(lane, _mm256_set1_ps(step[2])));
+
+    __m256 mask = _mm256_cmp_ps(_mm256_sub_ps(pz, _mm256_set1_ps(f.min_z)), zero, _CMP_GE_OQ);
+
+    //one reciprocal serves both image coordinates
+    const __m256 inv_z = _mm256_div_ps(one, pz);
+    const __m256 u = _mm256_add_ps(_mm256_set1_ps(f.cx), _mm256_mul_ps(_mm256_mul_ps(px, inv_z), _mm256_set1_ps(f.fx)));
+    const __m256 v = _mm256_add_ps(_mm256_set1_ps(f.cy), _mm256_mul_ps(_mm256_mul_ps(py, inv_z), _mm256_set1_ps(f.fy)));
+
+    //out of range and NaN coordinates convert to INT_MIN and fail the bounds test
+    const __m256i j = _mm256_cvtps_epi32(_mm256_floor_ps(_mm256_add_ps(u, half)));
+    const __m256i i = _mm256_cvtps_epi32(_mm256_floor_ps(_mm256_add_ps(v, half)));
+    const __m256i inside = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(i, zero_i), _mm256_cmpgt_epi32(last_row, i)),
+                                            _mm256_and_si256(_mm256_cmpgt_epi32(j, zero_i), _mm256_cmpgt_epi32(last_col, j)));
+    mask = _mm256_and_ps(mask, _mm256_castsi256_ps(inside));
+    if(_mm256_movemask_ps(mask) == 0) continue;
+
+    const __m256i pixel = _mm256_add_epi32(_mm256_mullo_epi32(i, width_i), j);
+    const __m256 depth = _mm256_mask_i32gather_ps(nan, f.depth, pixel, mask, 4);
+
+    const __m256 eta = _mm256_sub_ps(depth, pz);
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(eta, _mm256_set1_ps(f.Dmin), _CMP_GE_OQ));
+
+    const __m256 D = _mm256_min_ps(eta, _mm256_set1_ps(f.Dmax));
+    const __m256 W = _mm256_blendv_ps(
+      _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(f.Wslope), _mm256_sub_ps(D, _mm256_set1_ps(f.Dmin))), _mm256_set1_ps(1e-6f)), one,
+      _mm256_cmp_ps(_mm256_sub_ps(D, _mm256_set1_ps(1e-6f)), _mm256_set1_ps(f.Dmax), _CMP_LT_OQ));
+
+    //a dry run stands for a row of Dmax
+    const __m256 d_old = (d != NULL) ? _mm256_loadu_ps(d + first) : _mm256_set1_ps(f.Dmax);
+    const __m256 w_old = (w != NULL) ? _mm256_loadu_ps(w + first) : zero;
+    const __m256 unstable = _mm256_or_ps(_mm256_cmp_ps(w_old, _mm256_set1_ps(f.Wmax), _CMP_LT_OQ),
+      _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(D, d_old), abs_mask), _mm256_set1_ps(f.tolerance), _CMP_GT_OQ));
+    if(_mm256_movemask_ps(mask) != 0) result |= FUSION_OBSERVED;
+    if(_mm256_movemask_ps(_mm256_and_ps(mask, unstable)) != 0) result |= FUSION_UNSTABLE;
+
+    //the stored distance changes unless the average rounds back to it, a dry run would write D over Dmax
+    const __m256 w_sum = _mm256_add_ps(w_old, W);
+    const __m256 d_new = (d != NULL) ? _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(d_old, w_old), _mm256_mul_ps(D, W)), w_sum) : D;
+    if(_mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(d_new, d_old, _CMP_NEQ_OQ))) != 0) result |= FUSION_CHANGED;
+    if(d == NULL || !update) continue;
+
+    const __m256 w_new = _mm256_min_ps(w_sum, _mm256_set1_ps(f.Wmax));
+    _mm256_storeu_ps(d + first, _mm256_blendv_ps(d_old, d_new, mask));
+    _mm256_storeu_ps(w + first, _mm256_blendv_ps(w_old, w_new, mask));
+  }
+  return result;
+}
+
+__attribute__((target("avx512f")))
+static unsigned fuse_row_avx512(const fusion_frame &f, const float origin[3], const float step[3], float* d, float* w, bool update)
+{
+  const __m512 lane = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m512 px = _mm512_add_ps(_mm512_set1_ps(origin[0]), _mm512_mul_ps(lane, _mm512_set1_ps(step[0])));
+  const __m512 py = _mm512_add_ps(_mm512_set1_ps(origin[1]), _mm512_mul_ps(lane, _mm512_set1_ps(step[1])));
+  const __m512 pz = _mm512_add_ps(_mm512_set1_ps(origin[2]), _mm512_mul_ps(lane, _mm512_set1_ps(step[2])));
+
+  __mmask16 mask = _mm512_cmp_ps_mask(_mm512_sub_ps(pz, _mm512_set1_ps(f.min_z)), _mm512_setzero_ps(), _CMP_GE_OQ);
+
+  const __m512 inv_z = _mm512_div_ps(_mm512_set1_ps(1.0f), pz);
+  const __m512 u = _mm512_add_ps(_mm512_set1_ps(f.cx), _mm512_mul_ps(_mm512_mul_ps(px, inv_z), _mm512_set1_ps(f.fx)));
+  const __m512 v = _mm512_add_ps(_mm512_set1_ps(f.cy), _mm512_mul_ps(_mm512_mul_ps(py, inv_z), _mm512_set1_ps(f.fy)));
+
+  const __m512 half = _mm512_set1_ps(0.5f);
+  //the unmasked conversions leave their pass-through operand undefined, which GCC 12 warns about
+  const __mmask16 all = 0xFFFF;
+  const __m512i j = _mm512_maskz_cvt_roundps_epi32(all, _mm512_add_ps(u, half), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  const __m512i i = _mm512_maskz_cvt_roundps_epi32(all, _mm512_add_ps(v, half), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  const __m512i zero_i = _mm512_setzero_si512();
+  mask &= _mm512_cmpgt_epi32_mask(i, zero_i) & _mm512_cmpgt_epi32_mask(_mm512_set1_epi32(f.height-1), i) &
+          _mm512_cmpgt_epi32_mask(j, zero_i) & _mm512_cmpgt_epi32_mask(_mm512_set1_epi32(f.width-1), j);
+  if(mask == 0) return 0;
+
+  const __m512i pixel = _mm512_add_epi32(_mm512_mullo_epi32(i, _mm512_set1_epi32(f.width)), j);
+  const __m512 depth = _mm512_mask_i32gather_ps(_mm512_set1_ps(std::numeric_limits<float>::quiet_NaN()), mask, pixel, f.depth, 4);
+
+  const __m512 eta = _mm512_sub_ps(depth, pz);
+  mask &= _mm512_cmp_ps_mask(eta, _mm512_set1_ps(f.Dmin), _CMP_GE_OQ);
+
+  const __m512 D = _mm512_maskz_min_ps(all, eta, _mm512_set1_ps(f.Dmax));
+  const __mmask16 full_weight = _mm512_cmp_ps_mask(_mm512_sub_ps(D, _mm512_set1_ps(1e-6f)), _mm512_set1_ps(f.Dmax), _CMP_LT_OQ);
+  const __m512 W = _mm512_mask_mov_ps(
+    _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(f.Wslope), _mm512_sub_ps(D, _mm512_set1_ps(f.Dmin))), _mm512_set1_ps(1e-6f)),
+    full_weight, _mm512_set1_ps(1.0f));
+
+  const __m512 d_old = (d != NULL) ? _mm512_loadu_ps(d) : _mm512_set1_ps(f.Dmax);
+  const __m512 w_old = (w != NULL) ? _mm512_loadu_ps(w) : _mm512_setzero_ps();
+  const __mmask16 unstable = _mm512_cmp_ps_mask(w_old, _mm512_set1_ps(f.Wmax), _CMP_LT_OQ) |
+    _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(D, d_old)), _mm512_set1_ps(f.tolerance), _CMP_GT_OQ);
+  unsigned result = (mask != 0) ? unsigned(FUSION_OBSERVED) : 0u;
+  if((mask & unstable) != 0) result |= FUSION_UNSTABLE;
+
+  const __m512 w_sum = _mm512_add_ps(w_old, W);
+  const __m512 d_new = (d != NULL) ? _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(d_old, w_old), _mm512_mul_ps(D, W)), w_sum) : D;
+  if((mask & _mm512_cmp_ps_mask(d_new, d_old, _CMP_NEQ_OQ)) != 0) result |= FUSION_CHANGED;
+  if(d == NULL || !update) return result;
+
+  const __m512 w_new = _mm512_maskz_min_ps(all, w_sum, _mm512_set1_ps(f.Wmax));
+  _mm512_mask_storeu_ps(d, mask, d_new);
+  _mm512_mask_storeu_ps(w, mask, w_new);
+  return result;
+}
+
+fusion_isa detect_fusion_isa(void)
+{
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) return FUSION_AVX512;
+  if(__builtin_cpu_supports("avx2")) return FUSION_AVX2;
+  return FUSION_SCALAR;
+}
+
+unsigned fuse_row(fusion_isa isa, const fusion_frame &frame, const float origin[3], const float step[3], float* d, float* w,
+                  bool update)
+{
+  if(isa == FUSION_AVX512) return fuse_row_avx512(frame, origin, step, d, w, update);
+  return fuse_row_avx2(frame, origin, step, d, w, update);
+}
@@ -10,6 +10,8 @@
 #include <thrust/host_vector.h>
 #include <thrust/device_vector.h>
 #include <thrust/for_each.h>
+#include <thrust/extrema.h>
+#include <thrust/device_ptr.h>
 #include <thrust/execution_policy.h>
 #include <thrust/system_error.h>
 
@@ -19,6 +21,7 @@
 #include <iostream>
 #include <vector>
 #include <ctime>
+#include <cmath>
 
 
 void principal_components::load_dictionary(std::string &filename)
@@ -74,6 +77,13 @@ void principal_components::load_mean(std::string &filename)
 
 
 void principal_components::encode(thrust::device_vector<float> &input, thrust::device_vector<float> &output)
+{
+  output.resize(reduced_dim);
+  encode(input, thrust::raw_pointer_cast(&output[0]));
+}
+
+
+void principal_components::encode(thrust::device_vector<float> &input, float* output)
 {
 
   // cublasSgemv performs the computation y = alpha*( A*x ) + beta * y
@@ -84,7 +94,6 @@ void principal_components::encode(thrust::device_vector<float> &input, thrust::d
 
   thrust::device_vector<float> input_minus_mean;
   input_minus_mean.resize(input_dim);
-  output.resize(reduced_dim);
 
   //find the mean
 //  float mean = thrust::reduce(thrust::device, input.begin(), input.end())/float(input_dim);
@@ -108,7 +117,7 @@ void principal_components::encode(thrust::device_vector<float> &input, thrust::d
   //cublasSetStream(handle, Stream);
 
   (cublasSgemv( handle, CUBLAS_OP_T, 4096, reduced_dim, &alf, (thrust::raw_pointer_cast(&dev_weights[0])), 4096,
-    thrust::raw_pointer_cast(&input_minus_mean[0]), 1, &beta,thrust::raw_pointer_cast(&output[0]),1));
+    thrust::raw_pointer_cast(&input_minus_mean[0]), 1, &beta,output,1));
 
   (cublasDestroy(handle));
   //cudaStreamDestroy(Stream);
@@ -131,6 +140,12 @@ bool principal_components::describes_empty(thrust::device_vector<float> &input,
 
 
 void principal_components::decode(thrust::device_vector<float> &input, thrust::device_vector<float> &output)
+{
+  decode(thrust::raw_pointer_cast(&input[0]), output);
+}
+
+
+void principal_components::decode(const float* input, thrust::device_vector<float> &output)
 {
   // cublasSgemv performs the computation y = alpha*( A*x ) + beta * y
 
@@ -150,12 +165,64 @@ void principal_components::decode(thrust::device_vector<float> &input, thrust::d
   //cublasSetStream(handle, Stream);
 
   (cublasSgemv( handle, CUBLAS_OP_N, 4096, reduced_dim, &alf, (thrust::raw_pointer_cast(&dev_weights[0])), 4096,
-    thrust::raw_pointer_cast(&input[0]), 1, &beta,thrust::raw_pointer_cast(&output[0]),1));
+    input, 1, &beta,thrust::raw_pointer_cast(&output[0]),1));
 
   (cublasDestroy(handle));
   //cudaStreamDestroy(Stream);
 }
 
+void principal_components::encode_quantized(thrust::device_vector<float> &input, float* output)
+{
+  thrust::device_vector<float> coefficients;
+  encode(input, coefficients);
+
+  //the codes span [-127,127] symmetrically around the midpoint of the coefficient range
+  thrust::pair<thrust::device_vector<float>::iterator, thrust::device_vector<float>::iterator> range =
+    thrust::minmax_element(coefficients.begin(), coefficients.end());
+  const float lo = *range.first;
+  const float hi = *range.second;
+  const float offset = 0.5f*(lo+hi);
+  const float scale = (hi > lo) ? (hi-lo)/254.0f : 1.0f;
+
+  thrust::device_ptr<float> record(output);
+  record[0] = scale;
+  record[1] = offset;
+
+  thrust::device_ptr<signed char> codes(reinterpret_cast<signed char*>(output+2));
+  thrust::transform(coefficients.begin(), coefficients.end(), codes, quantize<float>(offset, 1.0f/scale));
+}
+
+
+void principal_components::decode_quantized(const float* input, thrust::device_vector<float> &output)
+{
+  thrust::device_ptr<const float> record(input);
+  const float scale = record[0];
+  const float offset = record[1];
+
+  thrust::device_ptr<const signed char> codes(reinterpret_cast<const signed char*>(input+2));
+  thrust::device_vector<float> coefficients(reduced_dim);
+  thrust::transform(codes, codes+reduced_dim, coefficients.begin(), dequantize<float>(scale, offset));
+
+  decode(coefficients, output);
+}
+
+
+void principal_components::compare_quantized(thrust::host_vector<float> &input, float &rms_float, float &rms_quantized)
+{
+  thrust::device_vector<float> original = input;
+  thrust::device_vector<float> reconstructed;
+  thrust::device_vector<float> descriptor;
+  thrust::device_vector<float> record(quantized_size());
+
+  encode(original, descriptor);
+  decode(descriptor, reconstructed);
+  rms_float = std::sqrt(L2sq_distance(original, reconstructed)/input_dim);
+
+  encode_quantized(original, thrust::raw_pointer_cast(&record[0]));
+  decode_quantized(thrust::raw_pointer_cast(&record[0]), reconstructed);
+  rms_quantized = std::sqrt(L2sq_distance(original, reconstructed)/input_dim);
+}
+
 void principal_components::compare(thrust::host_vector<float> &input, thrust::host_vector<float> &output)
 {
   thrust::device_vector<float> original = input;
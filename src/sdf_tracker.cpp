@@ -2,6 +2,10 @@
 #include <iostream>
 #include <limits>
 #include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+#include <omp.h>
 
 #include <Eigen/Core>
 #include <Eigen/StdVector>
@@ -31,6 +35,31 @@ int mod (int a, int b)
    return ret;
 }
 
+// Allocates the active volume in one block, aligned to a cache line. Large volumes are aligned to 2MB
+// and advised to use transparent huge pages since every SDF lookup and fusion update lands in them.
+// Sparse volumes skip the advice, so that only the pages of bricks that are actually used become resident.
+static void* AllocateVolume(size_t bytes, bool huge_pages = true)
+{
+  void* ptr = NULL;
+  const size_t huge_page = size_t(2) << 20;
+  const size_t alignment = (huge_pages && bytes >= huge_page) ? huge_page : 64;
+
+  if(posix_memalign(&ptr, alignment, bytes) != 0) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+  if(alignment == huge_page) madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+  return ptr;
+}
+
+// Interleaves the low 10 bits of x, y and z, so that sorting by the code keeps neighbouring bricks together
+static uint32_t MortonCode(uint32_t x, uint32_t y, uint32_t z)
+{
+  uint32_t code = 0;
+  for(int bit = 0; bit < 10; ++bit)
+    code |= (((x >> bit) & 1) << (3*bit)) | (((y >> bit) & 1) << (3*bit+1)) | (((z >> bit) & 1) << (3*bit+2));
+  return code;
+}
+
 SDF_Parameters::SDF_Parameters()
 {
   image_width = 640;
@@ -48,11 +77,33 @@ SDF_Parameters::SDF_Parameters()
   regularization = 0.01;
   min_pose_change = 0.01;
   min_parameter_update = 0.0001;
+  sparse_volume = false;
+  elide_empty_bricks = true;
+  quantized_descriptors = false;
+  resident_descriptors = 0;
+  brick_store_path = "/tmp/sdf_tracker_bricks";
+  vectorized_fusion = true;
+  surface_band_fusion = false;
+  freeze_frames = 0;
+  freeze_tolerance = 0.01;
+  keyframe_interval = 1;
+  keyframe_translation = 0.01;
+  keyframe_rotation = 0.01;
+  keyframe_depth_change = 0.005;
+  keyframe_averaging = false;
+  keyframe_stationary_translation = 0.002;
+  keyframe_stationary_rotation = 0.002;
+  tracking_budget = 0.0;
+  motion_decay = 0.8;
+  motion_max_translation = 0.05;
+  motion_max_rotation = 0.05;
+  pyramid_edge_threshold = 0.05;
   raycast_steps = 12;
   fx = 520.0;
   fy = 520.0;
   cx = 319.5;
   cy = 239.5;
+  calibration_width = 640;
   render_window = "Render";
 }
 
@@ -81,6 +132,10 @@ SDFTracker::~SDFTracker()
   }
   delete[] validityMask_;
 
+  for (int i = 0; i < parameters_.image_height; ++i)
+    delete[] averageMask_[i];
+  delete[] averageMask_;
+
   if(depthImage_!=NULL)
   delete depthImage_;
 
@@ -109,25 +164,66 @@ void SDFTracker::checkTranslation(int tolerance)
     translationMonitor_(2) -= shift[2]*16*parameters_.resolution;
     SetCurrentTransformation(T);
 
+    //the gating poses live in the same shifted frame
+    for(int d = 0; d < 3; ++d)
+    {
+      fusedTransformation_(d,3) -= shift[d]*16*parameters_.resolution;
+      pendingTransformation_(d,3) -= shift[d]*16*parameters_.resolution;
+      averageTransformation_(d,3) -= shift[d]*16*parameters_.resolution;
+    }
+
+    //so does the motion model, whose increments rotate about the origin
+    const Eigen::Vector3d moved(shift[0]*16*parameters_.resolution, shift[1]*16*parameters_.resolution, shift[2]*16*parameters_.resolution);
+    const Eigen::Matrix3d R = GetMat4_rodrigues_smallangle(velocity_).block<3,3>(0,0);
+    velocity_.tail<3>() += (R - Eigen::Matrix3d::Identity())*moved;
+
   }
 
 }
 
+//intrinsics of the image scaled by s, pixel centers stay pixel centers
+static void ScaleIntrinsics(double s, double &fx, double &fy, double &cx, double &cy)
+{
+  fx *= s;
+  fy *= s;
+  cx = (cx + 0.5)*s - 0.5;
+  cy = (cy + 0.5)*s - 0.5;
+}
+
 void SDFTracker::Init(SDF_Parameters &parameters)
 {
   parameters_ = parameters;
   frame_count_ = 0;
-  int downsample=1;
-  switch(parameters_.image_height)
+  if(parameters_.calibration_width > 0 && parameters_.calibration_width != parameters_.image_width)
+    ScaleIntrinsics(double(parameters_.image_width)/parameters_.calibration_width,
+                    parameters_.fx, parameters_.fy, parameters_.cx, parameters_.cy);
+  partial_.resize(parameters_.image_height);
+
+  size_t offset = 0;
+  for(int l = 0; l < pyramid_levels_; ++l)
   {
-  case 480: downsample = 1; break; //VGA
-  case 240: downsample = 2; break; //QVGA
-  case 120: downsample = 4; break; //QQVGA
+    pyramidWidth_[l] = parameters_.image_width >> l;
+    pyramidHeight_[l] = parameters_.image_height >> l;
+    pyramidOffset_[l] = offset;
+    offset += size_t(pyramidWidth_[l])*pyramidHeight_[l];
+
+    pyramidIntrinsics_[l][0] = parameters_.fx; pyramidIntrinsics_[l][1] = parameters_.fy;
+    pyramidIntrinsics_[l][2] = parameters_.cx; pyramidIntrinsics_[l][3] = parameters_.cy;
+    ScaleIntrinsics(1.0/(1 << l), pyramidIntrinsics_[l][0], pyramidIntrinsics_[l][1], pyramidIntrinsics_[l][2], pyramidIntrinsics_[l][3]);
+
+    const double* K = pyramidIntrinsics_[l];
+    rayX_[l].resize(pyramidWidth_[l]);
+    rayY_[l].resize(pyramidHeight_[l]);
+    for(int col = 0; col < pyramidWidth_[l]; ++col) rayX_[l][col] = float((col - K[2])/K[0]);
+    for(int row = 0; row < pyramidHeight_[l]; ++row) rayY_[l][row] = float((row - K[3])/K[1]);
+
+    const size_t pixels = size_t(pyramidWidth_[l])*pyramidHeight_[l];
+    levelPoints_[l].x.resize(pixels);
+    levelPoints_[l].y.resize(pixels);
+    levelPoints_[l].z.resize(pixels);
+    levelPoints_[l].rowStart.assign(pyramidHeight_[l]+1, 0);
   }
-  parameters_.fx /= downsample;
-  parameters_.fy /= downsample;
-  parameters_.cx /= downsample;
-  parameters_.cy /= downsample;
+  pyramid_.assign(offset, std::numeric_limits<float>::quiet_NaN());
 
   depthImage_ = new cimg_library::CImg<float>(parameters_.image_width,parameters_.image_height,1,1);
 
@@ -138,11 +234,28 @@ void SDFTracker::Init(SDF_Parameters &parameters)
     memset(validityMask_[i],0,parameters_.image_width);
   }
 
+  averageMask_ = new bool*[parameters_.image_height];
+  for (int i = 0; i < parameters_.image_height; ++i)
+    averageMask_[i] = new bool[parameters_.image_width];
+  depthSum_.assign(parameters_.image_width,parameters_.image_height,1,1,0.0f);
+  depthCount_.assign(parameters_.image_width,parameters_.image_height,1,1,0.0f);
+  averageDepth_.assign(parameters_.image_width,parameters_.image_height,1,1);
+  fusedDepth_.assign();
+  skipped_ = 0;
+  fused_count_ = 0;
+  pointCost_ = 0;
+  velocity_.setZero();
+  for(int l = 0; l < pyramid_levels_; ++l) lastPoints_[l] = 0;
+
   quit_ = false;
   first_frame_ = true;
   Pose_ << 0.0,0.0,0.0,0.0,0.0,0.0;
   translationMonitor_ << 0.0,0.0,0.0;
   Transformation_=parameters_.pose_offset*Eigen::MatrixXd::Identity(4,4);
+  fusedTransformation_ = Transformation_;
+  pendingTransformation_ = Transformation_;
+  averageTransformation_ = Transformation_;
+  averaged_ = 0;
 
   if(parameters_.interactive_mode)
   {
@@ -153,8 +266,11 @@ void SDFTracker::Init(SDF_Parameters &parameters)
   //  cv::namedWindow( parameters_.render_window, 0 );
   }
 
-   myGrid_ = new hyperGrid( parameters_.XSize/2,  parameters_.YSize/2,  parameters_.ZSize/2, parameters_.XSize, parameters_.YSize, parameters_.ZSize,
-                          parameters_.Wmax, parameters_.Dmax, parameters_.Dmin, parameters_.resolution);
+   myGrid_ = new sdfGrid( parameters_.XSize, parameters_.YSize, parameters_.ZSize,
+                          parameters_.Wmax, parameters_.Dmax, parameters_.Dmin, parameters_.resolution, parameters_.sparse_volume,
+                          parameters_.elide_empty_bricks, parameters_.quantized_descriptors,
+                          parameters_.resident_descriptors, parameters_.brick_store_path, parameters_.vectorized_fusion,
+                          parameters_.surface_band_fusion, parameters_.freeze_frames, parameters_.freeze_tolerance);
 
 };
 
@@ -237,8 +353,17 @@ To2D(const Eigen::Vector4d &location, double fx, double fy, double cx, double cy
   return pixel;
 };
 
+//offsets from I,J,K of the values that SDF and the three central differences of SDFGradient interpolate between
+static const int gradient_stencil[][3] = {
+  {1,0,1}, {1,0,2}, {2,0,1}, {2,0,2},
+  {0,1,1}, {0,1,2}, {1,1,0}, {1,1,1}, {1,1,2}, {1,1,3}, {2,1,0}, {2,1,1}, {2,1,2}, {2,1,3}, {3,1,1}, {3,1,2},
+  {0,2,1}, {0,2,2}, {1,2,0}, {1,2,1}, {1,2,2}, {1,2,3}, {2,2,0}, {2,2,1}, {2,2,2}, {2,2,3}, {3,2,1}, {3,2,2},
+  {1,3,1}, {1,3,2}, {2,3,1}, {2,3,2} };
+static const int gradient_stencil_size = sizeof(gradient_stencil)/sizeof(gradient_stencil[0]);
+
+template<class V>
 bool
-hyperGrid::ValidGradient(const Eigen::Vector4d &location)
+hyperGrid<V>::ValidGradient(const Eigen::Vector4d &location)
 {
  /*
  The function tests the current location and its adjacent
@@ -268,58 +393,86 @@ hyperGrid::ValidGradient(const Eigen::Vector4d &location)
    v              X--------X
   K                                                */
 
-  float eps = 10e-9;
+  const double fi = location(0)/cellSize_ + active_XSize_/2;
+  const double fj = location(1)/cellSize_ + active_YSize_/2;
+  const double fk = location(2)/cellSize_ + active_ZSize_/2;
 
-  double i,j,k;
-  modf(location(0)/cellSize_ + active_XSize_/2, &i);
-  modf(location(1)/cellSize_ + active_YSize_/2, &j);
-  modf(location(2)/cellSize_ + active_ZSize_/2, &k);
+  if(std::isnan(fi) || std::isnan(fj) || std::isnan(fk)) return false;
 
-  if(std::isnan(i) || std::isnan(j) || std::isnan(k)) return false;
+  int I = int(fi)-1; int J = int(fj)-1;   int K = int(fk)-1;
 
-  int I = int(i)-1; int J = int(j)-1;   int K = int(k)-1;
+  if(I>=int(active_XSize_)-4 || J>=int(active_YSize_)-3 || K>=int(active_ZSize_)-3 || I<=1 || J<=1 || K<=1)return false;
 
-  if(I>=active_XSize_-4 || J>=active_YSize_-3 || K>=active_ZSize_-3 || I<=1 || J<=1 || K<=1)return false;
+  const int x = wrap(I,0); const int y = wrap(J,1); const int z = wrap(K,2);
+  const uint16_t row = gradientMask_[brickIndex(x, y, z)*brickRows_ + (z%hyperCellSize_)*hyperCellSize_ + y%hyperCellSize_];
+  return (row >> (x%hyperCellSize_)) & 1;
+}
 
-  // 2* because weights and distances are packed into the same array
-  float D10 = activeVolume(I+1, J+0, 2*(K+1) );   float D10_1 = activeVolume(I+1, J+0, 2*(K+2) );
-  float D20 = activeVolume(I+2, J+0, 2*(K+1) );   float D20_1 = activeVolume(I+2, J+0, 2*(K+2) );
 
-  float D01 = activeVolume(I+0, J+1, 2*(K+1) );   float D01_1 = activeVolume(I+0, J+1, 2*(K+2) );
-  float D11 = activeVolume(I+1, J+1, 2*(K+0) );   float D11_1 = activeVolume(I+1, J+1, 2*(K+1) ); float D11_2 = activeVolume(I+1, J+1, 2*(K+2) ); float D11_3 = activeVolume(I+1, J+1, 2*(K+3) );
-  float D21 = activeVolume(I+2, J+1, 2*(K+0) );   float D21_1 = activeVolume(I+2, J+1, 2*(K+1) ); float D21_2 = activeVolume(I+2, J+1, 2*(K+2) ); float D21_3 = activeVolume(I+2, J+1, 2*(K+3) );
-  float D31 = activeVolume(I+3, J+1, 2*(K+1) );   float D31_1 = activeVolume(I+3, J+1, 2*(K+2) );
+// Trilinear interpolation in n between i,j,k and i+1,j+1,k+1, written out as in hyperGrid::SDF
+static inline double Trilinear(const float n[4][4][4], int i, int j, int k, double x, double y, double z)
+{
+  const double a1 = double(n[i][j][k]*(1-z)+n[i][j][k+1]*z);
+  const double a2 = double(n[i][j+1][k]*(1-z)+n[i][j+1][k+1]*z);
+  const double b1 = double(n[i+1][j][k]*(1-z)+n[i+1][j][k+1]*z);
+  const double b2 = double(n[i+1][j+1][k]*(1-z)+n[i+1][j+1][k+1]*z);
+  return double((a1*(1-y)+a2*y)*(1-x) + (b1*(1-y)+b2*y)*x);
+}
+
+template<class V>
+bool
+hyperGrid<V>::SDFAndGradient(const Eigen::Vector4d &location, double &value, Eigen::Vector3d &gradient)
+{
 
-  float D02 = activeVolume(I+0, J+2, 2*(K+1) );   float D02_1 = activeVolume(I+0, J+2, 2*(K+2) );
-  float D12 = activeVolume(I+1, J+2, 2*(K+0) );   float D12_1 = activeVolume(I+1, J+2, 2*(K+1) ); float D12_2 = activeVolume(I+1, J+2, 2*(K+2) ); float D12_3 = activeVolume(I+1, J+2, 2*(K+3) );
-  float D22 = activeVolume(I+2, J+2, 2*(K+0) );   float D22_1 = activeVolume(I+2, J+2, 2*(K+1) ); float D22_2 = activeVolume(I+2, J+2, 2*(K+2) ); float D22_3 = activeVolume(I+2, J+2, 2*(K+3) );
-  float D32 = activeVolume(I+3, J+2, 2*(K+1) );   float D32_1 = activeVolume(I+3, J+2, 2*(K+3) );
+  const double fi = location(0)/cellSize_ + active_XSize_/2;
+  const double fj = location(1)/cellSize_ + active_YSize_/2;
+  const double fk = location(2)/cellSize_ + active_ZSize_/2;
 
-  float D13 = activeVolume(I+1, J+3, 2*(K+1) );   float D13_1 = activeVolume(I+1, J+3, 2*(K+2) );
-  float D23 = activeVolume(I+2, J+3, 2*(K+1) );   float D23_1 = activeVolume(I+2, J+3, 2*(K+2) );
+  if(std::isnan(fi) || std::isnan(fj) || std::isnan(fk)) return false;
 
-  if( D10 > Dmax_-eps || D10_1 > Dmax_-eps ||
-      D20 > Dmax_-eps || D20_1 > Dmax_-eps ||
+  const int I = int(fi)-1; const int J = int(fj)-1; const int K = int(fk)-1;
 
-      D01 > Dmax_-eps || D01_1 > Dmax_-eps ||
-      D11 > Dmax_-eps || D11_1 > Dmax_-eps || D11_2 > Dmax_-eps || D11_3 > Dmax_-eps ||
-      D21 > Dmax_-eps || D21_1 > Dmax_-eps || D21_2 > Dmax_-eps || D21_3 > Dmax_-eps ||
-      D31 > Dmax_-eps || D31_1 > Dmax_-eps ||
+  if(I>=int(active_XSize_)-4 || J>=int(active_YSize_)-3 || K>=int(active_ZSize_)-3 || I<=1 || J<=1 || K<=1)return false;
 
-      D02 > Dmax_-eps || D02_1 > Dmax_-eps ||
-      D12 > Dmax_-eps || D12_1 > Dmax_-eps || D12_2 > Dmax_-eps || D12_3 > Dmax_-eps ||
-      D22 > Dmax_-eps || D22_1 > Dmax_-eps || D22_2 > Dmax_-eps || D22_3 > Dmax_-eps ||
-      D32 > Dmax_-eps || D32_1 > Dmax_-eps ||
+  int w[3][4];
+  for (int d = 0; d < 4; ++d) { w[0][d] = wrap(I+d,0); w[1][d] = wrap(J+d,1); w[2][d] = wrap(K+d,2); }
+  const uint16_t row = gradientMask_[brickIndex(w[0][0], w[1][0], w[2][0])*brickRows_ +
+                                     (w[2][0]%hyperCellSize_)*hyperCellSize_ + w[1][0]%hyperCellSize_];
+  if(!((row >> (w[0][0]%hyperCellSize_)) & 1)) return false;
 
-      D13 > Dmax_-eps || D13_1 > Dmax_-eps ||
-      D23 > Dmax_-eps || D23_1 > Dmax_-eps
-      ) return false;
-  else return true;
-}
+  float n[4][4][4];
+  const distance_t* N = stencil(I, J, K, 4);
+  if(N != NULL)
+  {
+    for (int s = 0; s < gradient_stencil_size; ++s)
+    {
+      const int* o = gradient_stencil[s];
+      n[o[0]][o[1]][o[2]] = codec_.distance(N[o[0]*stride_x_ + o[1]*stride_y_ + o[2]*stride_z_]);
+    }
+  }
+  else
+  {
+    //the stencil straddles bricks
+    for (int s = 0; s < gradient_stencil_size; ++s)
+    {
+      const int* o = gradient_stencil[s];
+      n[o[0]][o[1]][o[2]] = codec_.distance(activeDistance_[voxelOffset(w[0][o[0]], w[1][o[1]], w[2][o[2]])]);
+    }
+  }
 
+  //SDF samples the location and the locations one voxel away on either side, which share its fractional position
+  const double x = fi-int(fi); const double y = fj-int(fj); const double z = fk-int(fk);
+  const double delta = 2.0*double(cellSize_);
+  value = Trilinear(n, 1, 1, 1, x, y, z);
+  gradient << (Trilinear(n, 2, 1, 1, x, y, z) - Trilinear(n, 0, 1, 1, x, y, z))/delta,
+              (Trilinear(n, 1, 2, 1, x, y, z) - Trilinear(n, 1, 0, 1, x, y, z))/delta,
+              (Trilinear(n, 1, 1, 2, x, y, z) - Trilinear(n, 1, 1, 0, x, y, z))/delta;
+  return true;
+}
 
+template<class V>
 double
-hyperGrid::SDFGradient(const Eigen::Vector4d &location, int stepSize, int dim )
+hyperGrid<V>::SDFGradient(const Eigen::Vector4d &location, int stepSize, int dim )
 {
   double delta=cellSize_*stepSize;
   Eigen::Vector4d location_offset = Eigen::Vector4d(0,0,0,1);
@@ -340,106 +493,336 @@ SDFTracker::UpdateDepth(const cimg_library::CImg<float> &depth)
   for(int row=0; row<depthImage_->height()-0; ++row)
   for(int col=0; col<depthImage_->width()-0; ++col)
       validityMask_[row][col] = !std::isnan(depth(col,row));
+
+  BuildPyramid();
+  BuildPoints();
+}
+
+void
+SDFTracker::BuildPyramid(void)
+{
+  #pragma omp parallel
+  {
+    #pragma omp for schedule(static)
+    for(int row = 0; row < pyramidHeight_[0]; ++row)
+      std::copy(depthImage_->data(0,row), depthImage_->data(0,row) + pyramidWidth_[0], &pyramid_[size_t(row)*pyramidWidth_[0]]);
+
+    for(int l = 1; l < pyramid_levels_; ++l)
+    {
+      const float* fine = &pyramid_[pyramidOffset_[l-1]];
+      float* coarse = &pyramid_[pyramidOffset_[l]];
+      const int fine_width = pyramidWidth_[l-1];
+
+      //the implicit barrier of each level keeps the next from reading it early
+      #pragma omp for schedule(static)
+      for(int row = 0; row < pyramidHeight_[l]; ++row)
+      for(int col = 0; col < pyramidWidth_[l]; ++col)
+      {
+        const float* block = fine + size_t(2*row)*fine_width + 2*col;
+        const float d[4] = {block[0], block[1], block[fine_width], block[fine_width+1]};
+
+        //NaN fails every comparison, so invalid pixels neither become the reference nor join the average
+        float nearest = std::numeric_limits<float>::infinity();
+        for(int n = 0; n < 4; ++n) if(d[n] < nearest) nearest = d[n];
+
+        const float limit = nearest*(1.0f + float(parameters_.pyramid_edge_threshold));
+        float sum = 0.0f;
+        int count = 0;
+        for(int n = 0; n < 4; ++n) if(d[n] <= limit) { sum += 1.0f/d[n]; ++count; }
+        coarse[size_t(row)*pyramidWidth_[l] + col] = count ? count/sum : std::numeric_limits<float>::quiet_NaN();
+      }
+    }
+  }
+}
+
+void
+SDFTracker::BuildPoints(void)
+{
+  for(int l = 0; l < pyramid_levels_; ++l)
+  {
+    const float* depth = &pyramid_[pyramidOffset_[l]];
+    const int width = pyramidWidth_[l], height = pyramidHeight_[l];
+    point_cloud &points = levelPoints_[l];
+
+    //count the valid pixels of each row, then write each row at its offset
+    #pragma omp parallel for schedule(static)
+    for(int row = 0; row < height; ++row)
+    {
+      int count = 0;
+      for(int col = 0; col < width; ++col) count += !std::isnan(depth[size_t(row)*width + col]);
+      points.rowStart[row+1] = count;
+    }
+    for(int row = 0; row < height; ++row) points.rowStart[row+1] += points.rowStart[row];
+
+    #pragma omp parallel for schedule(static)
+    for(int row = 0; row < height; ++row)
+    {
+      int n = points.rowStart[row];
+      for(int col = 0; col < width; ++col)
+      {
+        const float d = depth[size_t(row)*width + col];
+        if(std::isnan(d)) continue;
+        points.x[n] = rayX_[l][col]*d;
+        points.y[n] = rayY_[l][row]*d;
+        points.z[n] = d;
+        ++n;
+      }
+    }
+  }
 }
 
 void
 SDFTracker::FuseDepth(void)
 {
+  ++frame_count_;
+
+  if(parameters_.keyframe_interval > 1 && !Keyframe())
+  {
+    if(skipped_ + 1 < parameters_.keyframe_interval)
+    {
+      ++skipped_;
+      if(parameters_.keyframe_averaging) AccumulateDepth();
+      return;
+    }
+
+    //the interval is up while the camera stays put, the current frame closes the average
+    if(parameters_.keyframe_averaging)
+    {
+      AccumulateDepth();
+      FusePending();
+      fusedTransformation_ = Transformation_;
+      fusedDepth_ = *depthImage_;
+      skipped_ = 0;
+      return;
+    }
+  }
+
+  //frames held back since the last keyframe were taken from about where that keyframe was, not from here
+  if(parameters_.keyframe_averaging && skipped_ > 0) FusePending();
+
   Eigen::Matrix4d wtc = Transformation_.inverse();
   myGrid_->FuseDepth(wtc, depthImage_, validityMask_, parameters_.fx, parameters_.fy, parameters_.cx, parameters_.cy);
+  ++fused_count_;
+
+  if(parameters_.keyframe_interval > 1)
+  {
+    fusedTransformation_ = Transformation_;
+    fusedDepth_ = *depthImage_;
+  }
+  skipped_ = 0;
+}
+
+//whether the camera moved more than translation or turned more than rotation between the two poses
+static bool Moved(const Eigen::Matrix4d &from, const Eigen::Matrix4d &to, double translation, double rotation)
+{
+  const Eigen::Matrix4d delta = from.inverse()*to;
+  const double cos_angle = std::max(-1.0, std::min(1.0, (delta.block<3,3>(0,0).trace() - 1.0)/2.0));
+  return delta.block<3,1>(0,3).norm() > translation || acos(cos_angle) > rotation;
+}
+
+bool
+SDFTracker::Keyframe(void)
+{
+  if(fusedDepth_.is_empty()) return true;
+
+  if(Moved(fusedTransformation_, Transformation_, parameters_.keyframe_translation, parameters_.keyframe_rotation))
+    return true;
+
+  //a sparse grid of pixels is enough to notice a change in the scene
+  double change = 0;
+  int pixels = 0;
+  #pragma omp parallel for reduction(+:change,pixels) schedule(static)
+  for(int row = 0; row < depthImage_->height(); row += 4)
+  for(int col = 0; col < depthImage_->width(); col += 4)
+  {
+    const float now = (*depthImage_)(col,row);
+    const float then = fusedDepth_(col,row);
+    if(std::isnan(now) || std::isnan(then)) continue;
+    change += std::fabs(now - then);
+    ++pixels;
+  }
+  return pixels == 0 || change/pixels > parameters_.keyframe_depth_change;
+}
+
+void
+SDFTracker::AccumulateDepth(void)
+{
+  //skipped frames may still be keyframe_translation apart, only those taken from where the average started join it
+  if(averaged_ > 0 && Moved(averageTransformation_, Transformation_, parameters_.keyframe_stationary_translation,
+                            parameters_.keyframe_stationary_rotation))
+    FusePending();
+  if(averaged_ == 0) averageTransformation_ = Transformation_;
+  ++averaged_;
+
+  #pragma omp parallel for schedule(static)
+  for(int row = 0; row < depthImage_->height(); ++row)
+  for(int col = 0; col < depthImage_->width(); ++col)
+  {
+    if(!validityMask_[row][col]) continue;
+    depthSum_(col,row) += (*depthImage_)(col,row);
+    depthCount_(col,row) += 1.0f;
+  }
+  pendingTransformation_ = Transformation_;
+}
+
+void
+SDFTracker::FusePending(void)
+{
+  if(averaged_ == 0) return;
+  averaged_ = 0;
+
+  #pragma omp parallel for schedule(static)
+  for(int row = 0; row < depthImage_->height(); ++row)
+  for(int col = 0; col < depthImage_->width(); ++col)
+  {
+    averageMask_[row][col] = depthCount_(col,row) > 0;
+    averageDepth_(col,row) = averageMask_[row][col] ? depthSum_(col,row)/depthCount_(col,row) : std::numeric_limits<float>::quiet_NaN();
+  }
+  depthSum_.fill(0.0f);
+  depthCount_.fill(0.0f);
+
+  Eigen::Matrix4d wtc = pendingTransformation_.inverse();
+  myGrid_->FuseDepth(wtc, &averageDepth_, averageMask_, parameters_.fx, parameters_.fy, parameters_.cx, parameters_.cy);
+  ++fused_count_;
 }
 
 
 Vector6d
 SDFTracker::EstimatePoseFromDepth(void)
 {
-  Vector6d xi;
-  xi<<0.0,0.0,0.0,0.0,0.0,0.0; // + (Pose-previousPose)*0.1;
+  typedef std::chrono::high_resolution_clock clock;
+  const clock::time_point deadline = (parameters_.tracking_budget > 0) ?
+    clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(parameters_.tracking_budget)) :
+    clock::time_point::max();
+  return EstimatePoseFromDepth(deadline, trackingReport_);
+}
+
+Vector6d
+SDFTracker::EstimatePoseFromDepth(const std::chrono::high_resolution_clock::time_point &deadline, tracking_report &report)
+{
+  typedef std::chrono::high_resolution_clock clock;
+  const clock::time_point start = clock::now();
+  report.iterations = 0;
+  report.deadline_hit = false;
+  report.predicted = false;
+  report.fell_back = false;
+
+  //constant velocity, unless the last increment was too large to trust
+  Vector6d prediction = parameters_.motion_decay*velocity_;
+  if(prediction.tail<3>().norm() > parameters_.motion_max_translation ||
+     prediction.head<3>().norm() > parameters_.motion_max_rotation)
+    prediction.setZero();
+  report.predicted = !prediction.isZero();
+
+  Vector6d xi = GaussNewton(prediction, deadline, report);
+
+  //a prediction that lost most of the surface is worse than none. Counts are only comparable on the same level, a
+  //frame the deadline stopped at a coarse level has fewer points without having lost anything
+  const int level = report.finest_level;
+  if(report.predicted && level < pyramid_levels_ && (report.points == 0 || report.points < lastPoints_[level]/2) &&
+     clock::now() < deadline)
+  {
+    report.fell_back = true;
+    xi = GaussNewton(Vector6d::Zero(), deadline, report);
+  }
+
+  if(report.points > 0)
+  {
+    velocity_ = xi;
+    lastPoints_[report.finest_level] = report.points;
+  }
+  else velocity_.setZero();
+
+  report.seconds = std::chrono::duration<double>(clock::now() - start).count();
+  return xi;
+}
+
+Vector6d
+SDFTracker::GaussNewton(const Vector6d &initial, const std::chrono::high_resolution_clock::time_point &deadline,
+                        tracking_report &report)
+{
+  typedef std::chrono::high_resolution_clock clock;
+  report.finest_level = pyramid_levels_;
+  report.residual = 0;
+  report.points = 0;
+
+  bool out_of_time = false;
+
+  Vector6d xi = initial;
   Vector6d xi_prev = xi;
   const float eps = 10e-9;
   const float c = parameters_.robust_statistic_coefficient*parameters_.Dmax;
 
-  const int iterations[3]={12, 8, 2};
-  const int stepSize[3] = {4, 2, 1};
+  const int iterations[pyramid_levels_]={12, 8, 2};
 
-  for(int lvl=0; lvl < 3; ++lvl)
+  //coarse to fine
+  for(int lvl=0; lvl < pyramid_levels_; ++lvl)
   {
+    const int level = pyramid_levels_-1-lvl;
+    const point_cloud &points = levelPoints_[level];
+    if(out_of_time) break;
+
     for(int k=0; k<iterations[lvl]; ++k)
     {
+      if(pointCost_ > 0)
+      {
+        //move on early only if an iteration on the next level still fits now but would not after this one
+        const double remaining = std::chrono::duration<double>(deadline - clock::now()).count();
+        const double cost = pointCost_*points.rowStart.back();
+        const double next = (level > 0) ? pointCost_*levelPoints_[level-1].rowStart.back() : 0.0;
+        if(cost > remaining) { report.deadline_hit = out_of_time = true; break; }
+        if(k > 0 && next <= remaining && cost + next > remaining) { report.deadline_hit = true; break; }
+      }
+      //until an iteration has been timed there is nothing to plan with, only stop once the deadline has passed
+      else if(clock::now() >= deadline) { report.deadline_hit = out_of_time = true; break; }
+      const clock::time_point tic = clock::now();
 
       const Eigen::Matrix4d camToWorld = GetMat4_rodrigues_smallangle(xi)*Transformation_;
 
-      float A00=0.0;//,A01=0.0,A02=0.0,A03=0.0,A04=0.0,A05=0.0;
-      float A10=0.0,A11=0.0;//,A12=0.0,A13=0.0,A14=0.0,A15=0.0;
-      float A20=0.0,A21=0.0,A22=0.0;//,A23=0.0,A24=0.0,A25=0.0;
-      float A30=0.0,A31=0.0,A32=0.0,A33=0.0;//,A34=0.0,A35=0.0;
-      float A40=0.0,A41=0.0,A42=0.0,A43=0.0,A44=0.0;//,A45=0.0;
-      float A50=0.0,A51=0.0,A52=0.0,A53=0.0,A54=0.0,A55=0.0;
-
-      float g0=0.0, g1=0.0, g2=0.0, g3=0.0, g4=0.0, g5=0.0;
+      //one partial system per row of the level, merged in a fixed order so the result does not depend on the thread count
+      const int rows = pyramidHeight_[level];
 
-      #pragma omp parallel for schedule(static) \
-      default(shared) collapse(2) \
-      reduction(+:g0,g1,g2,g3,g4,g5,A00,A10,A11,A20,A21,A22,A30,A31,A32,A33,A40,A41,A42,A43,A44,A50,A51,A52,A53,A54,A55)
-      for(int row=0; row<depthImage_->height()-0; row+=stepSize[lvl])
+      #pragma omp parallel for schedule(static) default(shared)
+      for(int row=0; row<rows; ++row)
       {
-        for(int col=0; col<depthImage_->width()-0; col+=stepSize[lvl])
+        partial_[row].clear();
+        for(int n=points.rowStart[row]; n<points.rowStart[row+1]; ++n)
         {
-          if(!validityMask_[row][col]) continue;
-          float depth = (*depthImage_)(col,row);
-          Eigen::Vector4d currentPoint = camToWorld*To3D(row,col,depth,parameters_.fx,parameters_.fy,parameters_.cx,parameters_.cy);
+          Eigen::Vector4d currentPoint = camToWorld*Eigen::Vector4d(points.x[n], points.y[n], points.z[n], 1.0);
 
-          if(!myGrid_->ValidGradient(currentPoint)) continue;
-          float D = (myGrid_->SDF(currentPoint));
-          float Dabs = fabsf(D);
+          //value and partial derivative of SDF wrt position
+          double D;
+          Eigen::Vector3d gradient;
+          if(!myGrid_->SDFAndGradient(currentPoint, D, gradient)) continue;
+          double Dabs = fabs(D);
           if(D > parameters_.Dmax - eps || D < parameters_.Dmin + eps) continue;
 
-          //partial derivative of SDF wrt position
-          Eigen::Matrix<double,1,3> dSDF_dx(myGrid_->SDFGradient(currentPoint,1,0),
-                                            myGrid_->SDFGradient(currentPoint,1,1),
-                                            myGrid_->SDFGradient(currentPoint,1,2)
-                                            );
-          //partial derivative of position wrt optimizaiton parameters
-          Eigen::Matrix<double,3,6> dx_dxi;
-          dx_dxi << 0, currentPoint(2), -currentPoint(1), 1, 0, 0,
-                    -currentPoint(2), 0, currentPoint(0), 0, 1, 0,
-                    currentPoint(1), -currentPoint(0), 0, 0, 0, 1;
-
-          //jacobian = derivative of SDF wrt xi (chain rule)
-          Eigen::Matrix<double,1,6> J = dSDF_dx*dx_dxi;
+          //jacobian = derivative of SDF wrt xi (chain rule), the gradient times the partial derivative of position
+          //wrt optimization parameters
+          //  0   z  -y  1 0 0
+          // -z   0   x  0 1 0
+          //  y  -x   0  0 0 1
+          const double J[6] = {gradient(2)*currentPoint(1) - gradient(1)*currentPoint(2),
+                               gradient(0)*currentPoint(2) - gradient(2)*currentPoint(0),
+                               gradient(1)*currentPoint(0) - gradient(0)*currentPoint(1),
+                               gradient(0), gradient(1), gradient(2)};
 
           //double tukey = (1-(Dabs/c)*(Dabs/c))*(1-(Dabs/c)*(Dabs/c));
           double huber = Dabs < c ? 1.0 : c/Dabs;
 
           //Gauss - Newton approximation to hessian
-          Eigen::Matrix<double,6,6> T1 = huber * J.transpose() * J;
-          Eigen::Matrix<double,1,6> T2 = huber * J.transpose() * D;
-
-          g0 = g0 + T2(0); g1 = g1 + T2(1); g2 = g2 + T2(2);
-          g3 = g3 + T2(3); g4 = g4 + T2(4); g5 = g5 + T2(5);
+          partial_[row].add(J, huber, D);
 
-          A00+=T1(0,0);//A01+=T1(0,1);A02+=T1(0,2);A03+=T1(0,3);A04+=T1(0,4);A05+=T1(0,5);
-          A10+=T1(1,0);A11+=T1(1,1);//A12+=T1(1,2);A13+=T1(1,3);A14+=T1(1,4);A15+=T1(1,5);
-          A20+=T1(2,0);A21+=T1(2,1);A22+=T1(2,2);//A23+=T1(2,3);A24+=T1(2,4);A25+=T1(2,5);
-          A30+=T1(3,0);A31+=T1(3,1);A32+=T1(3,2);A33+=T1(3,3);//A34+=T1(3,4);A35+=T1(3,5);
-          A40+=T1(4,0);A41+=T1(4,1);A42+=T1(4,2);A43+=T1(4,3);A44+=T1(4,4);//A45+=T1(4,5);
-          A50+=T1(5,0);A51+=T1(5,1);A52+=T1(5,2);A53+=T1(5,3);A54+=T1(5,4);A55+=T1(5,5);
-
-        }//col
+        }//point
       }//row
+      normal_equations::reduce(partial_, rows);
+      report.points = partial_[0].count();
+      report.residual = (report.points > 0) ? std::sqrt(partial_[0].error()/report.points) : 0.0;
 
       Eigen::Matrix<double,6,6> A;
-
-      A<< A00,A10,A20,A30,A40,A50,
-          A10,A11,A21,A31,A41,A51,
-          A20,A21,A22,A32,A42,A52,
-          A30,A31,A32,A33,A43,A53,
-          A40,A41,A42,A43,A44,A54,
-          A50,A51,A52,A53,A54,A55;
-     double scaling = 1/A.maxCoeff();
-
       Vector6d g;
-      g<< g0, g1, g2, g3, g4, g5;
+      partial_[0].expand(A, g);
+      double scaling = 1/A.maxCoeff();
 
       g *= scaling;
       A *= scaling;
@@ -449,10 +832,20 @@ SDFTracker::EstimatePoseFromDepth(void)
       Vector6d Change = xi-xi_prev;
       double Cnorm = Change.norm();
       xi_prev = xi;
+
+      ++report.iterations;
+      report.finest_level = level;
+      if(points.rowStart.back() > 0)
+        pointCost_ = std::chrono::duration<double>(clock::now() - tic).count()/points.rowStart.back();
+
       if(Cnorm < parameters_.min_parameter_update) break;
     }//k
   }//level
-  if(std::isnan(xi.sum())) xi << 0.0,0.0,0.0,0.0,0.0,0.0;
+  if(std::isnan(xi.sum()))
+  {
+    xi << 0.0,0.0,0.0,0.0,0.0,0.0;
+    report.points = 0;
+  }
   return xi;
 };//function
 
@@ -570,7 +963,8 @@ SDFTracker::SetCurrentTransformation(const Eigen::Matrix4d &T)
   translationMonitor_ += Eigen::Vector3d(T(0,3),T(1,3),T(2,3)) - Eigen::Vector3d(translationMonitor_(0),translationMonitor_(1),translationMonitor_(2));
 }
 
-void hyperGrid::SaveSDF(const std::string &filename)
+template<class V>
+void hyperGrid<V>::SaveSDF(const std::string &filename)
 {
 
 // http://www.vtk.org/Wiki/VTK/Examples/Cxx/IO/WriteVTI
@@ -748,7 +1142,8 @@ void hyperGrid::SaveSDF(const std::string &filename)
   // writer->Write();
 }
 
-void hyperGrid::LoadSDF(const std::string &filename)
+template<class V>
+void hyperGrid<V>::LoadSDF(const std::string &filename)
 {
 
   // // //double valuerange[2];
@@ -798,457 +1193,957 @@ void hyperGrid::LoadSDF(const std::string &filename)
 }
 
 
-void hyperGrid::shiftActiveGrid(int X, int Y, int Z)
+template<class V>
+bool hyperGrid<V>::emptyBrick(const distance_t* brick_d)
 {
+  const float eps = 10e-9;
 
+  //the scan stops at the first voxel below Dmax
+  for (uint idx = 0; idx < brickVoxels_; ++idx)
+    if(!codec_.truncated(brick_d[idx], Dmax_-eps)) return false;
+  return true;
+}
 
-  float decoded_w = 1.0f;
-  float empty_tolerance = 1e-9f;
-  if (X>0)
+template<class V>
+void hyperGrid<V>::normalizeBrick(const distance_t* brick_d, thrust::host_vector<float> &voxels)
+{
+  voxels.resize(brickVoxels_);
+  for (uint idx = 0; idx < brickVoxels_; ++idx)
+    voxels[idx] = (codec_.distance(brick_d[idx]) - Dmin_)/(Dmax_-Dmin_);
+}
+
+template<class V>
+void hyperGrid<V>::ReportDescriptorError(void)
+{
+  thrust::host_vector<float> voxels;
+  double sum_float = 0, sum_quantized = 0;
+  float max_float = 0, max_quantized = 0;
+  int bricks = 0;
+
+  const size_t num_bricks = (active_XSize_/hyperCellSize_)*(active_YSize_/hyperCellSize_)*(active_ZSize_/hyperCellSize_);
+  for (size_t brick = 0; brick < num_bricks; ++brick)
   {
+    const int slot = brickTable_[brick];
+    if(slot == 0) continue;
+
+    const distance_t* brick_d = activeDistance_ + size_t(slot)*brickVoxels_;
+    if(emptyBrick(brick_d)) continue;
+
+    float rms_float, rms_quantized;
+    normalizeBrick(brick_d, voxels);
+    PCA.compare_quantized(voxels, rms_float, rms_quantized);
+
+    //back from the codec's [0,1] range to meters
+    rms_float *= (Dmax_-Dmin_);
+    rms_quantized *= (Dmax_-Dmin_);
+    sum_float += rms_float;
+    sum_quantized += rms_quantized;
+    max_float = std::max(max_float, rms_float);
+    max_quantized = std::max(max_quantized, rms_quantized);
+    ++bricks;
+  }
 
-    for (int k = 0; k < active_ZSize_/16 ; ++k)
-    for (int j = 0; j < active_YSize_/16 ; ++j)
-    for (int i = 0; i < 1; ++i)
-    {
-      thrust::host_vector<float> host_voxels_encode;
-      thrust::host_vector<float> host_voxels_decode;
-      thrust::device_vector<float> dev_voxels;
-      int DEC_X = active_XSize_/16 + active_offset_[0] + block_shift_[0];
-      int DEC_Y = active_offset_[1] + j+block_shift_[1];
-      int DEC_Z = active_offset_[2] + k+block_shift_[2];
-
-      int ENC_X = active_offset_[0] + i+block_shift_[0];
-      int ENC_Y = active_offset_[1] + j+block_shift_[1];
-      int ENC_Z = active_offset_[2] + k+block_shift_[2];
-
-      //check if this block should be decoded
-      bool decode = (hGrid_ [DEC_X][DEC_Y][DEC_Z].descriptor.size() > 0);
-
-      //then decode it
-      if(decode)
-      {
-          PCA.decode(hGrid_[DEC_X][DEC_Y][DEC_Z].descriptor, dev_voxels);
-          host_voxels_decode = dev_voxels;
-      }
+  const int n = (bricks > 0) ? bricks : 1;
+  std::cout << "descriptor reconstruction error over " << bricks << " bricks (RMS m), float: mean " << sum_float/n
+            << " max " << max_float << ", int8: mean " << sum_quantized/n << " max " << max_quantized << std::endl;
+  std::cout << "descriptor size " << PCA.descriptor_size()*sizeof(float) << " bytes float, "
+            << PCA.quantized_size()*sizeof(float) << " bytes int8" << std::endl;
+}
 
-      //go through the block
-      int idx = 0;
-      for (int kk = 0; kk < 16; ++kk)
-      for (int jj = 0; jj < 16; ++jj)
-      for (int ii = 0; ii < 16; ++ii)
-      {
-        host_voxels_encode.push_back( (activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) - Dmin_)/(Dmax_-Dmin_) );
+template<class V>
+void hyperGrid<V>::ReportPaging(void)
+{
+  const long fetches = descriptors_.hits() + descriptors_.misses();
+  std::cout << "descriptors: " << descriptors_.resident() << " resident, " << descriptors_.spilled() << " spilled, "
+            << descriptors_.spills() << " spills" << std::endl;
+  std::cout << "fetches: " << fetches << ", hit rate " << ((fetches > 0) ? double(descriptors_.hits())/fetches : 1.0)
+            << ", mean page-in " << ((descriptors_.misses() > 0) ? 1e6*descriptors_.page_in_time()/descriptors_.misses() : 0.0)
+            << " us" << std::endl;
+}
 
-        activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ?  host_voxels_decode[idx]*(Dmax_- Dmin_) + Dmin_ : (Dmax_);
-        activeVolume_w(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ? decoded_w : 0.0f;
-        ++idx;
-      }
-      dev_voxels = host_voxels_encode;
+template<class V>
+void hyperGrid<V>::pageBrick(int i, int j, int k, int DEC_X, int DEC_Y, int DEC_Z, int ENC_X, int ENC_Y, int ENC_Z)
+{
+  const float decoded_w = 1.0f;
+  const int brick_numel = hyperCellSize_*hyperCellSize_*hyperCellSize_;
 
-      PCA.encode( dev_voxels, hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
-      // hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].contents = GetType(hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
-    }
+  thrust::host_vector<float> host_voxels_encode(brick_numel);
+  thrust::host_vector<float> host_voxels_decode;
+  thrust::device_vector<float> dev_voxels;
+
+  //check if this block should be decoded
+  gridCell* dec = hGrid_.find(DEC_X, DEC_Y, DEC_Z);
+  bool decode = (dec != NULL && descriptors_.stored(*dec));
+
+  //bricks tagged as empty were observed free space, they are refilled with Dmax without going through the codec
+  bool refill_empty = (dec != NULL && dec->empty);
+
+  //then decode it, faulting it in first if it was spilled to the brick store. The descriptor and the empty tag are
+  //kept, so that the brick can leave again without being encoded as long as fusion does not change it
+  if(decode)
+  {
+      const float* descriptor = descriptors_.fetch(*dec);
+      if(quantize_descriptors_) PCA.decode_quantized(descriptor, dev_voxels);
+      else PCA.decode(descriptor, dev_voxels);
+      host_voxels_decode = dev_voxels;
   }
-  else if (X<0)
+
+  //the brick is contiguous and already in descriptor order, so it is streamed through in one pass
+  int &slot = brickTable_[activeBrick(i, j, k)];
+  char &dirty = brickDirty_[activeBrick(i, j, k)];
+
+  //unallocated bricks of a sparse volume were never observed and leave no descriptor behind
+  if(slot != 0 && dirty)
   {
-    for (int k = 0; k < active_ZSize_/16 ; ++k)
-    for (int j = 0; j < active_YSize_/16 ; ++j)
-    for (int i = active_XSize_/16-1; i < active_XSize_/16 ; ++i)
+    const distance_t* brick_d = activeDistance_ + size_t(slot)*brickVoxels_;
+
+    bool empty = elide_empty_ && emptyBrick(brick_d);
+
+    gridCell &enc = hGrid_.insert(ENC_X, ENC_Y, ENC_Z);
+    enc.empty = empty;
+    if(empty)
     {
-      thrust::host_vector<float> host_voxels_encode;
-      thrust::host_vector<float> host_voxels_decode;
-      thrust::device_vector<float> dev_voxels;
-      int DEC_X = active_offset_[0] - 1+block_shift_[0];
-      int DEC_Y = active_offset_[1] + j+block_shift_[1];
-      int DEC_Z = active_offset_[2] + k+block_shift_[2];
-
-      int ENC_X = active_XSize_/16 + active_offset_[0] - 1+block_shift_[0];
-      int ENC_Y =                    active_offset_[1] + j+block_shift_[1];
-      int ENC_Z =                    active_offset_[2] + k+block_shift_[2];
-
-      //check if this block should be decoded
-      bool decode = (hGrid_ [DEC_X][DEC_Y][DEC_Z].descriptor.size() > 0);
-
-      //then decode it
-      if(decode)
-      {
-          PCA.decode(hGrid_[DEC_X][DEC_Y][DEC_Z].descriptor, dev_voxels);
-          host_voxels_decode = dev_voxels;
-      }
+      descriptors_.release(enc);
+    }
+    else
+    {
+      normalizeBrick(brick_d, host_voxels_encode);
 
-      //go through the block
-      int idx = 0;
-      for (int kk = 0; kk < 16; ++kk)
-      for (int jj = 0; jj < 16; ++jj)
-      for (int ii = 0; ii < 16; ++ii)
-      {
-        host_voxels_encode.push_back( (activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) - Dmin_)/(Dmax_-Dmin_) );
-        activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ?  host_voxels_decode[idx]*(Dmax_- Dmin_) + Dmin_ : (Dmax_);
-        activeVolume_w(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ? decoded_w : 0.0f;
-        ++idx;
-      }
       dev_voxels = host_voxels_encode;
-      PCA.encode( dev_voxels, hGrid_[ENC_X][ENC_Y][ENC_Z].descriptor);
-      // hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].contents = GetType(hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
+      float* descriptor = descriptors_.acquire(enc);
+      if(quantize_descriptors_) PCA.encode_quantized( dev_voxels, descriptor);
+      else PCA.encode( dev_voxels, descriptor);
     }
+    // hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].contents = GetType(hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
   }
 
-  if (Y>0)
-  {
+  dirty = 0;
+  brickStable_[activeBrick(i, j, k)] = 0;
+  brickTouched_[activeBrick(i, j, k)] = 1;
 
-    for (int k = 0; k < active_ZSize_/16 ; ++k)
-    for (int j = 0; j < 1; ++j)
-    for (int i = 0; i < active_XSize_/16 ; ++i)
-    {
-      thrust::host_vector<float> host_voxels_encode;
-      thrust::host_vector<float> host_voxels_decode;
-      thrust::device_vector<float> dev_voxels;
-      int DEC_X = active_offset_[0] + i+block_shift_[0];
-      int DEC_Y = active_YSize_/16 + active_offset_[1] + block_shift_[1];
-      int DEC_Z = active_offset_[2] + k+block_shift_[2];
-
-      int ENC_X = active_offset_[0] + i+block_shift_[0];
-      int ENC_Y = active_offset_[1] + j+block_shift_[1];
-      int ENC_Z = active_offset_[2] + k+block_shift_[2];
-
-      //check if this block should be decoded
-      bool decode = (hGrid_ [DEC_X][DEC_Y][DEC_Z].descriptor.size() > 0);
-
-      //then decode it
-      if(decode)
-      {
-          PCA.decode(hGrid_[DEC_X][DEC_Y][DEC_Z].descriptor, dev_voxels);
-          host_voxels_decode = dev_voxels;
-        // }
-      }
+  //in a sparse volume, bricks that come back empty stay unallocated
+  if(sparse_ && slot != 0 && !decode)
+  {
+    releaseBrick(slot);
+    slot = 0;
+  }
+  if(sparse_ && slot == 0 && decode) slot = allocateBrick();
+  if(slot == 0) return;
+
+  distance_t* brick_d = activeDistance_ + size_t(slot)*brickVoxels_;
+  weight_t* brick_w = activeWeight_ + size_t(slot)*brickVoxels_;
+  for (int idx = 0; idx < brick_numel; ++idx)
+    codec_.set(brick_d[idx], brick_w[idx], decode ?  host_voxels_decode[idx]*(Dmax_- Dmin_) + Dmin_ : (Dmax_),
+                                           (decode || refill_empty) ? decoded_w : 0.0f);
+}
 
-      //go through the block
-      int idx = 0;
-      for (int kk = 0; kk < 16; ++kk)
-      for (int jj = 0; jj < 16; ++jj)
-      for (int ii = 0; ii < 16; ++ii)
-      {
-        host_voxels_encode.push_back( (activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) - Dmin_)/(Dmax_-Dmin_) );
+template<class V>
+void hyperGrid<V>::shiftActiveGrid(int X, int Y, int Z)
+{
+  const int BX = active_XSize_/hyperCellSize_;
+  const int BY = active_YSize_/hyperCellSize_;
+  const int BZ = active_ZSize_/hyperCellSize_;
 
-        activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ?  host_voxels_decode[idx]*(Dmax_- Dmin_) + Dmin_ : (Dmax_);
-        activeVolume_w(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ? decoded_w : 0.0f;
-        ++idx;
-      }
-      dev_voxels = host_voxels_encode;
+  if (X>0)
+  {
+    for (int k = 0; k < BZ ; ++k)
+    for (int j = 0; j < BY ; ++j)
+    {
+      int i = 0;
+      pageBrick(i, j, k,
+                BX + active_offset_[0] + block_shift_[0],
+                active_offset_[1] + j + block_shift_[1],
+                active_offset_[2] + k + block_shift_[2],
+                active_offset_[0] + i + block_shift_[0],
+                active_offset_[1] + j + block_shift_[1],
+                active_offset_[2] + k + block_shift_[2]);
+    }
+  }
+  else if (X<0)
+  {
+    for (int k = 0; k < BZ ; ++k)
+    for (int j = 0; j < BY ; ++j)
+    {
+      int i = BX-1;
+      pageBrick(i, j, k,
+                active_offset_[0] - 1 + block_shift_[0],
+                active_offset_[1] + j + block_shift_[1],
+                active_offset_[2] + k + block_shift_[2],
+                BX + active_offset_[0] - 1 + block_shift_[0],
+                     active_offset_[1] + j + block_shift_[1],
+                     active_offset_[2] + k + block_shift_[2]);
+    }
+  }
 
-      PCA.encode( dev_voxels, hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
-      // hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].contents = GetType(hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
+  if (Y>0)
+  {
+    for (int k = 0; k < BZ ; ++k)
+    for (int i = 0; i < BX ; ++i)
+    {
+      int j = 0;
+      pageBrick(i, j, k,
+                active_offset_[0] + i + block_shift_[0],
+                BY + active_offset_[1] + block_shift_[1],
+                active_offset_[2] + k + block_shift_[2],
+                active_offset_[0] + i + block_shift_[0],
+                active_offset_[1] + j + block_shift_[1],
+                active_offset_[2] + k + block_shift_[2]);
     }
   }
   else if (Y<0)
   {
-
-    for (int k = 0; k < active_ZSize_/16 ; ++k)
-    for (int j = active_YSize_/16-1; j < active_YSize_/16 ; ++j)
-    for (int i = 0; i < active_XSize_/16 ; ++i)
+    for (int k = 0; k < BZ ; ++k)
+    for (int i = 0; i < BX ; ++i)
     {
-      thrust::host_vector<float> host_voxels_encode;
-      thrust::host_vector<float> host_voxels_decode;
-      thrust::device_vector<float> dev_voxels;
-      int DEC_X = active_offset_[0] + i+block_shift_[0];
-      int DEC_Y = active_offset_[1] - 1+block_shift_[1];
-      int DEC_Z = active_offset_[2] + k+block_shift_[2];
-
-      int ENC_X =                    active_offset_[0] + i+block_shift_[0];
-      int ENC_Y = active_YSize_/16 + active_offset_[1] - 1+block_shift_[1];
-      int ENC_Z =                    active_offset_[2] + k+block_shift_[2];
-
-      //check if this block should be decoded
-      bool decode = (hGrid_ [DEC_X][DEC_Y][DEC_Z].descriptor.size() > 0);
-
-      //then decode it
-      if(decode)
-      {
-          PCA.decode(hGrid_[DEC_X][DEC_Y][DEC_Z].descriptor, dev_voxels);
-          host_voxels_decode = dev_voxels;
-      }
-
-      //go through the block
-      int idx = 0;
-      for (int kk = 0; kk < 16; ++kk)
-      for (int jj = 0; jj < 16; ++jj)
-      for (int ii = 0; ii < 16; ++ii)
-      {
-        host_voxels_encode.push_back( (activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) - Dmin_)/(Dmax_-Dmin_) );
-        activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ?  host_voxels_decode[idx]*(Dmax_- Dmin_) + Dmin_ : (Dmax_);
-        activeVolume_w(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ? decoded_w : 0.0f;
-        ++idx;
-      }
-      dev_voxels = host_voxels_encode;
-      PCA.encode( dev_voxels, hGrid_[ENC_X][ENC_Y][ENC_Z].descriptor);
-      // hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].contents = GetType(hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
+      int j = BY-1;
+      pageBrick(i, j, k,
+                active_offset_[0] + i + block_shift_[0],
+                active_offset_[1] - 1 + block_shift_[1],
+                active_offset_[2] + k + block_shift_[2],
+                     active_offset_[0] + i + block_shift_[0],
+                BY + active_offset_[1] - 1 + block_shift_[1],
+                     active_offset_[2] + k + block_shift_[2]);
     }
   }
 
   if (Z>0)
   {
-
-    for (int k = 0; k < 1; ++k)
-    for (int j = 0; j < active_YSize_/16 ; ++j)
-    for (int i = 0; i < active_XSize_/16 ; ++i)
+    for (int j = 0; j < BY ; ++j)
+    for (int i = 0; i < BX ; ++i)
     {
-      thrust::host_vector<float> host_voxels_encode;
-      thrust::host_vector<float> host_voxels_decode;
-      thrust::device_vector<float> dev_voxels;
-
-      int DEC_X = active_offset_[0] + i+block_shift_[0];
-      int DEC_Y = active_offset_[1] + j+block_shift_[1];
-      int DEC_Z = active_ZSize_/16 + active_offset_[2] + block_shift_[2];
-
-      int ENC_X = active_offset_[0] + i+block_shift_[0];
-      int ENC_Y = active_offset_[1] + j+block_shift_[1];
-      int ENC_Z = active_offset_[2] + k+block_shift_[2];
-
-      //check if this block should be decoded
-      bool decode = (hGrid_ [DEC_X][DEC_Y][DEC_Z].descriptor.size() > 0);
-
-      //then decode it
-      if(decode)
-      {
-          PCA.decode(hGrid_[DEC_X][DEC_Y][DEC_Z].descriptor, dev_voxels);
-          host_voxels_decode = dev_voxels;
-        // }
-      }
-
-      //go through the block
-      int idx = 0;
-      for (int kk = 0; kk < 16; ++kk)
-      for (int jj = 0; jj < 16; ++jj)
-      for (int ii = 0; ii < 16; ++ii)
-      {
-        host_voxels_encode.push_back( (activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) - Dmin_)/(Dmax_-Dmin_) );
-
-        activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ?  host_voxels_decode[idx]*(Dmax_- Dmin_) + Dmin_ : (Dmax_);
-        activeVolume_w(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ? decoded_w : 0.0f;
-        ++idx;
-      }
-      dev_voxels = host_voxels_encode;
-
-      PCA.encode( dev_voxels, hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
-      // hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].contents = GetType(hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
-
+      int k = 0;
+      pageBrick(i, j, k,
+                active_offset_[0] + i + block_shift_[0],
+                active_offset_[1] + j + block_shift_[1],
+                BZ + active_offset_[2] + block_shift_[2],
+                active_offset_[0] + i + block_shift_[0],
+                active_offset_[1] + j + block_shift_[1],
+                active_offset_[2] + k + block_shift_[2]);
     }
-
   }
   else if (Z<0)
   {
-
-    for (int k = active_ZSize_/16-1; k < active_ZSize_/16 ; ++k)
-    for (int j = 0; j < active_YSize_/16 ; ++j)
-    for (int i = 0; i < active_XSize_/16 ; ++i)
+    for (int j = 0; j < BY ; ++j)
+    for (int i = 0; i < BX ; ++i)
     {
-      thrust::host_vector<float> host_voxels_encode;
-      thrust::host_vector<float> host_voxels_decode;
-      thrust::device_vector<float> dev_voxels;
-      int DEC_X = active_offset_[0] + i + block_shift_[0];
-      int DEC_Y = active_offset_[1] + j + block_shift_[1];
-      int DEC_Z = active_offset_[2] - 1 + block_shift_[2];
-
-      int ENC_X =                    active_offset_[0] + i+block_shift_[0];
-      int ENC_Y =                    active_offset_[1] + j+block_shift_[1];
-      int ENC_Z = active_ZSize_/16 + active_offset_[2] - 1+block_shift_[2];
-
-      //check if this block should be decoded
-      bool decode = (hGrid_ [DEC_X][DEC_Y][DEC_Z].descriptor.size() > 0);
-
-      //then decode it
-      if(decode)
-      {
-          PCA.decode(hGrid_[DEC_X][DEC_Y][DEC_Z].descriptor, dev_voxels);
-          host_voxels_decode = dev_voxels;
-      }
-
-      //go through the block
-      int idx = 0;
-      for (int kk = 0; kk < 16; ++kk)
-      for (int jj = 0; jj < 16; ++jj)
-      for (int ii = 0; ii < 16; ++ii)
-      {
-        host_voxels_encode.push_back( (activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) - Dmin_)/(Dmax_-Dmin_) );
-        activeVolume(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ?  host_voxels_decode[idx]*(Dmax_- Dmin_) + Dmin_ : (Dmax_);
-        activeVolume_w(i*16+ii, j*16+jj, 2*(k*16+kk)) = decode ? decoded_w : 0.0f;
-        ++idx;
-      }
-      dev_voxels = host_voxels_encode;
-      PCA.encode( dev_voxels, hGrid_[ENC_X][ENC_Y][ENC_Z].descriptor);
-      // hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].contents = GetType(hGrid_[ ENC_X ][ ENC_Y ][ ENC_Z ].descriptor);
+      int k = BZ-1;
+      pageBrick(i, j, k,
+                active_offset_[0] + i + block_shift_[0],
+                active_offset_[1] + j + block_shift_[1],
+                active_offset_[2] - 1 + block_shift_[2],
+                     active_offset_[0] + i + block_shift_[0],
+                     active_offset_[1] + j + block_shift_[1],
+                BZ + active_offset_[2] - 1 + block_shift_[2]);
     }
   }
   block_shift_[0] += X;
   block_shift_[1] += Y;
   block_shift_[2] += Z;
+  updateRing();
+  UpdateMasks();
 }
 
 
-void hyperGrid::Clear(){
-
-    for (int i = 0; i < active_XSize_; ++i)
-    {
-      for (int j = 0; j < active_YSize_; ++j)
-      {
-        if (activeVolume_[i][j]!=NULL)
-        delete[] activeVolume_[i][j];
-      }
+template<class V>
+void hyperGrid<V>::Clear(){
 
-      if (activeVolume_[i]!=NULL)
-      delete[] activeVolume_[i];
-    }
-    if(activeVolume_!=NULL)
-    delete[] activeVolume_;
+    if(activeDistance_!=NULL)
+    free(activeDistance_);
+    if(activeWeight_!=NULL)
+    free(activeWeight_);
+    if(brickTable_!=NULL)
+    delete[] brickTable_;
+    activeDistance_ = NULL;
+    activeWeight_ = NULL;
+    brickTable_ = NULL;
+    freeBricks_.clear();
   }
 
 
-void hyperGrid::Init()
+template<class V>
+void hyperGrid<V>::Init()
 {
   
   std::string dictionary_file = pca_dictionary_path+"/pca_64.pickle";
   std::string mean_file = pca_dictionary_path+"/mean.pickle";
   PCA.load_mean(mean_file);
   PCA.load_dictionary(dictionary_file);
+  descriptors_.reset(quantize_descriptors_ ? PCA.quantized_size() : PCA.descriptor_size(), resident_limit_, store_path_);
   
   //std::string file = nn_definitions_path + "/network_definitions/nn64/";
   //NN.load_network(file, 4);
 
-  hGrid_ = new gridCell**[hyper_XSize_];
-  for (int i = 0; i < hyper_XSize_; ++i){
-    hGrid_[i] = new gridCell*[hyper_YSize_];
-    for (int j = 0; j < hyper_YSize_; ++j){
-      hGrid_[i][j] = new gridCell[hyper_ZSize_];
-    }
-  }
-
-  int lbx = hyper_XSize_/2.0 - (active_XSize_/2.0)/16.0;
-  int ubx = lbx + active_XSize_/16.0;
-  int lby = hyper_YSize_/2.0 - (active_YSize_/2.0)/16.0;
-  int uby = lby + active_YSize_/16.0;
-  int lbz = hyper_ZSize_/2.0 - (active_ZSize_/2.0)/16.0;
-  int ubz = lbz + active_ZSize_/16.0;
+  hGrid_.clear();
 
-  active_offset_[0]=lbx;
-  active_offset_[1]=lby;
-  active_offset_[2]=lbz;
+  //bricks are keyed by their position in the world, in units of hyperCellSize_ voxels, with the
+  //initial active volume centered on the origin
+  active_offset_[0] = -int(active_XSize_/hyperCellSize_)/2;
+  active_offset_[1] = -int(active_YSize_/hyperCellSize_)/2;
+  active_offset_[2] = -int(active_ZSize_/hyperCellSize_)/2;
+  updateRing();
 
   // for (int x = 0; x < hyper_XSize_; ++x)
   //   for (int y = 0; y < hyper_YSize_; ++y)
   //     for (int z = 0; z < hyper_ZSize_; ++z)
   //       // hGrid_[x][y][z].contents = EMPTY;
 
-  activeVolume_ = new float**[active_XSize_];
-  for (int i = 0; i < active_XSize_; ++i){
-    activeVolume_[i] = new float*[active_YSize_];
-    for (int j = 0; j < active_YSize_; ++j){
-      activeVolume_[i][j] = new float[active_ZSize_*2];
-    }
+  //the pool is sized for every brick plus the shared empty one. In sparse mode the pages of slots that are never
+  //handed out are never touched, so the resident size follows the number of allocated bricks
+  const int num_bricks = (active_XSize_/hyperCellSize_)*(active_YSize_/hyperCellSize_)*(active_ZSize_/hyperCellSize_);
+  const size_t numel = size_t(num_bricks+1)*brickVoxels_;
+  activeDistance_ = static_cast<distance_t*>(AllocateVolume(numel*sizeof(distance_t), !sparse_));
+  activeWeight_ = static_cast<weight_t*>(AllocateVolume(numel*sizeof(weight_t), !sparse_));
+  brickTable_ = new int[num_bricks];
+
+  for (int slot = num_bricks; slot > 0; --slot) freeBricks_.push_back(slot);
+  for (size_t idx = 0; idx < brickVoxels_; ++idx){
+    codec_.set(activeDistance_[idx], activeWeight_[idx], Dmax_, 0.0f);
+  }
+  for (int brick = 0; brick < num_bricks; ++brick){
+    brickTable_[brick] = sparse_ ? 0 : allocateBrick();
+  }
+
+  const int BX = active_XSize_/hyperCellSize_;
+  const int BY = active_YSize_/hyperCellSize_;
+  std::vector<std::pair<uint32_t, int> > keyed(num_bricks);
+  for (int brick = 0; brick < num_bricks; ++brick){
+    keyed[brick] = std::make_pair(MortonCode(brick % BX, (brick / BX) % BY, brick / (BX*BY)), brick);
+  }
+  std::sort(keyed.begin(), keyed.end());
+  mortonBricks_.resize(num_bricks);
+  for (int m = 0; m < num_bricks; ++m) mortonBricks_[m] = keyed[m].second;
+  brickVisible_.assign(num_bricks, 0);
+  brickDirty_.assign(num_bricks, 0);
+  brickStable_.assign(num_bricks, 0);
+  brickTouched_.assign(num_bricks, 0);
+  nearMask_.assign(size_t(num_bricks)*brickRows_, 0);
+  gradientMask_.assign(size_t(num_bricks)*brickRows_, 0);
+
+};
+
+template<class V>
+void
+hyperGrid<V>::FuseDepth(Eigen::Matrix4d &worldToCam, cimg_library::CImg<float> *depthImage, bool** validityMask, float fx, float fy, float cx, float cy)
+{
+  float step[3];
+  fusion_frame frame = MakeFrame(worldToCam, depthImage->width(), depthImage->height(), fx, fy, cx, cy, step);
+  const double min_z = (worldToCam * Eigen::Vector4d(0.0,0.0,0.0,1.0))(2);
+
+  if(band_fusion_)
+  {
+    visibleBricks_.clear();
+    FuseBand(worldToCam, *depthImage, validityMask, frame, min_z);
+    UpdateMasks();
+    return;
+  }
+
+  float* fusable = NULL;
+  if(fusion_isa_ != FUSION_SCALAR)
+  {
+    fusableDepth_.resize(1);
+    fusableDepth_[0].resize(size_t(frame.width)*frame.height);
+    fusable = &fusableDepth_[0][0];
+    frame.depth = fusable;
   }
-  for (int x = 0; x < active_XSize_; ++x){
-    for (int y = 0; y < active_YSize_; ++y){
-      for (int z = 0; z < active_ZSize_; ++z){
-        activeVolume_[x][y][z*2]=Dmax_;
-        activeVolume_[x][y][z*2+1]=0.0f;
+
+  float max_depth = 0;
+
+  //One parallel region per frame. The threads that scan the depth image go on to cull and then fuse, the latter as
+  //tasks over tiles of neighbouring bricks so that threads that run out of work take tiles queued by the others
+  #pragma omp parallel
+  {
+    ScanDepth(*depthImage, validityMask, fusable, max_depth);
+    CullBricks(worldToCam, min_z, max_depth - Dmin_, frame.width, frame.height, fx, fy, cx, cy);
+
+    #pragma omp single
+    {
+      //several tiles per thread leave room to balance the uneven cost of surface and free-space bricks
+      const int visible = int(visibleBricks_.size());
+      const int tile = std::max(1, visible/(8*omp_get_num_threads()));
+      for(int first = 0; first < visible; first += tile)
+      {
+        const int last = std::min(first + tile, visible);
+        #pragma omp task firstprivate(first, last)
+        for(int b = first; b < last; ++b)
+          FuseBrick(visibleBricks_[b], worldToCam, *depthImage, validityMask, frame, step, min_z);
       }
     }
   }
-
+  UpdateMasks();
+  return;
 };
 
+template<class V>
 void
-hyperGrid::FuseDepth(Eigen::Matrix4d &worldToCam, cimg_library::CImg<float> *depthImage, bool** validityMask, float fx, float fy, float cx, float cy)
+hyperGrid<V>::FuseDepthBatch(const std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > &worldToCam,
+                             const std::vector<cimg_library::CImg<float>*> &depthImages, const std::vector<bool**> &validityMasks,
+                             float fx, float fy, float cx, float cy)
 {
+  const int frames = int(depthImages.size());
+
+  //rays gain nothing from batching
+  if(band_fusion_)
+  {
+    for(int f = 0; f < frames; ++f)
+    {
+      Eigen::Matrix4d pose = worldToCam[f];
+      FuseDepth(pose, depthImages[f], validityMasks[f], fx, fy, cx, cy);
+    }
+    return;
+  }
 
-  const float Wslope = 1/(Dmax_ - Dmin_);
-  Eigen::Vector4d camera = worldToCam * Eigen::Vector4d(0.0,0.0,0.0,1.0);
+  std::vector<fusion_frame> frame(frames);
+  std::vector<float> step(3*frames);
+  std::vector<double> min_z(frames);
+  std::vector<std::vector<char> > visible(frames);
+  if(fusion_isa_ != FUSION_SCALAR) fusableDepth_.resize(frames);
 
-  //Main 3D reconstruction loop
-  for(int x = 0; x<active_XSize_; ++x)
+  for(int f = 0; f < frames; ++f)
   {
-   #pragma omp parallel for \
-  shared(x)
-    for(int y = 0; y<active_YSize_;++y)
+    frame[f] = MakeFrame(worldToCam[f], depthImages[f]->width(), depthImages[f]->height(), fx, fy, cx, cy, &step[3*f]);
+    min_z[f] = (worldToCam[f] * Eigen::Vector4d(0.0,0.0,0.0,1.0))(2);
+    if(fusion_isa_ != FUSION_SCALAR)
     {
+      fusableDepth_[f].resize(size_t(frame[f].width)*frame[f].height);
+      frame[f].depth = &fusableDepth_[f][0];
+    }
+  }
+
+  //a brick only stays hot while the depth images it is fused from stay in cache too, so long batches go in passes of
+  //as many frames as fit in batch_cache_bytes
+  const size_t image_bytes = std::max<size_t>(1, size_t(depthImages.empty() ? 1 : depthImages[0]->size())*sizeof(float));
+  const int pass = std::max<int>(1, int(batch_cache_bytes/image_bytes));
+
+  float max_depth = 0;
 
-      for(int z = 0; z<active_ZSize_; ++z)
+  #pragma omp parallel
+  for(int first = 0; first < frames; first += pass)
+  {
+    const int last = std::min(first + pass, frames);
+    for(int f = first; f < last; ++f)
+    {
+      ScanDepth(*depthImages[f], validityMasks[f], (fusion_isa_ != FUSION_SCALAR) ? &fusableDepth_[f][0] : NULL, max_depth);
+      CullBricks(worldToCam[f], min_z[f], max_depth - Dmin_, frame[f].width, frame[f].height, fx, fy, cx, cy);
+      #pragma omp single
+      visible[f] = brickVisible_;
+    }
+
+    //every brick seen by any frame of the pass is visited once and takes the frames in order, so each voxel sees the
+    //same sequence of updates as with one FuseDepth per frame
+    #pragma omp single
+    {
+      visibleBricks_.clear();
+      for(size_t m = 0; m < mortonBricks_.size(); ++m)
+        for(int f = first; f < last; ++f)
+          if(visible[f][mortonBricks_[m]]) { visibleBricks_.push_back(mortonBricks_[m]); break; }
+
+      const int bricks = int(visibleBricks_.size());
+      const int tile = std::max(1, bricks/(8*omp_get_num_threads()));
+      for(int begin = 0; begin < bricks; begin += tile)
       {
-        //define a ray and point it into the center of a node
-        Eigen::Vector4d ray((x-active_XSize_/2.0)*cellSize_, (y- active_YSize_/2.0)*cellSize_ , (z- active_ZSize_/2.0)*cellSize_, 1);
-        ray = worldToCam*ray;
-        if(ray(2)-camera(2) < 0) continue;
+        const int end = std::min(begin + tile, bricks);
+        #pragma omp task firstprivate(begin, end)
+        for(int b = begin; b < end; ++b)
+          for(int f = first; f < last; ++f)
+            if(visible[f][visibleBricks_[b]])
+              FuseBrick(visibleBricks_[b], worldToCam[f], *depthImages[f], validityMasks[f], frame[f], &step[3*f], min_z[f]);
+      }
+    }
+  }
+  UpdateMasks();
+}
+
+template<class V>
+void
+hyperGrid<V>::UpdateMasks(void)
+{
+  const int BX = active_XSize_/hyperCellSize_;
+  const int BY = active_YSize_/hyperCellSize_;
+  const int BZ = active_ZSize_/hyperCellSize_;
+  const int H = hyperCellSize_;
+  const float eps = 10e-9;
+  const double threshold = Dmax_-eps;
+
+  std::vector<int> touched;
+  for(size_t b = 0; b < brickTouched_.size(); ++b)
+    if(brickTouched_[b]) { touched.push_back(int(b)); brickTouched_[b] = 0; }
+  if(touched.empty()) return;
+
+  //a voxel is in the stencils of the voxels up to three below it on each axis, so a brick's gradient bits also
+  //depend on the bricks above it
+  std::vector<char> stale(brickTouched_.size(), 0);
+  for(size_t t = 0; t < touched.size(); ++t)
+  {
+    const int bx = touched[t] % BX, by = (touched[t] / BX) % BY, bz = touched[t] / (BX*BY);
+    for(int d = 0; d < 8; ++d)
+      stale[(size_t(mod(bz - (d>>2), BZ))*BY + mod(by - ((d>>1)&1), BY))*BX + mod(bx - (d&1), BX)] = 1;
+  }
+  std::vector<int> update;
+  for(size_t b = 0; b < stale.size(); ++b)
+    if(stale[b]) update.push_back(int(b));
+
+  #pragma omp parallel for schedule(static)
+  for(int t = 0; t < int(touched.size()); ++t)
+  {
+    const distance_t* brick_d = activeDistance_ + size_t(brickTable_[touched[t]])*brickVoxels_;
+    uint16_t* near = &nearMask_[size_t(touched[t])*brickRows_];
+    for(int r = 0; r < brickRows_; ++r)
+    {
+      unsigned bits = 0;
+      for(int x = 0; x < H; ++x)
+        bits |= unsigned(!codec_.truncated(brick_d[r*H + x], threshold)) << x;
+      near[r] = uint16_t(bits);
+    }
+  }
+
+  #pragma omp parallel for schedule(static)
+  for(int t = 0; t < int(update.size()); ++t)
+  {
+    const int bx = update[t] % BX, by = (update[t] / BX) % BY, bz = update[t] / (BX*BY);
+
+    //near rows from z,y up to z+3,y+3, each followed by its continuation in the next brick along x
+    uint32_t rows[19][19];
+    for(int d = 0; d < 8; ++d)
+    {
+      const int nx = d&1, ny = (d>>1)&1, nz = d>>2;
+      const uint16_t* near = &nearMask_[((size_t(mod(bz + nz, BZ))*BY + mod(by + ny, BY))*BX + mod(bx + nx, BX))*brickRows_];
+      for(int z = nz*H; z < std::min(nz*H + H, 19); ++z)
+      for(int y = ny*H; y < std::min(ny*H + H, 19); ++y)
+      {
+        const uint32_t row = near[(z - nz*H)*H + y - ny*H];
+        rows[z][y] = nx ? (rows[z][y] | row << H) : row;
+      }
+    }
+
+    //gradient_stencil needs x offsets 0 to 3 in the four rows at y and z offsets 1 and 2, and x offsets 1 and 2 in
+    //the eight rows around them
+    uint16_t* gradient = &gradientMask_[size_t(update[t])*brickRows_];
+    for(int z = 0; z < H; ++z)
+    for(int y = 0; y < H; ++y)
+    {
+      const uint32_t center = rows[z+1][y+1] & rows[z+1][y+2] & rows[z+2][y+1] & rows[z+2][y+2];
+      const uint32_t all = center & rows[z][y+1] & rows[z][y+2] & rows[z+3][y+1] & rows[z+3][y+2] &
+                           rows[z+1][y] & rows[z+2][y] & rows[z+1][y+3] & rows[z+2][y+3];
+      gradient[z*H + y] = uint16_t((all >> 1) & (all >> 2) & center & (center >> 3));
+    }
+  }
+}
+
+template<class V>
+fusion_frame
+hyperGrid<V>::MakeFrame(const Eigen::Matrix4d &worldToCam, int width, int height, float fx, float fy, float cx, float cy, float step[3])
+{
+  fusion_frame frame;
+  frame.depth = NULL;
+  frame.width = width; frame.height = height;
+  frame.fx = fx; frame.fy = fy; frame.cx = cx; frame.cy = cy;
+  frame.min_z = (worldToCam * Eigen::Vector4d(0.0,0.0,0.0,1.0))(2);
+  frame.Dmin = Dmin_; frame.Dmax = Dmax_; frame.Wmax = Wmax_; frame.Wslope = 1/(Dmax_ - Dmin_);
+  frame.tolerance = freeze_tolerance_;
+  for(int d = 0; d < 3; ++d) step[d] = worldToCam(d,0)*cellSize_;
+  return frame;
+}
+
+template<class V>
+void
+hyperGrid<V>::ScanDepth(const cimg_library::CImg<float> &depthImage, bool** validityMask, float* fusable, float &max_depth)
+{
+  const int width = depthImage.width();
+  const int height = depthImage.height();
+
+  #pragma omp single
+  max_depth = 0;
+
+  //the deepest valid measurement bounds how far in front of the camera anything can be fused. The vector kernels
+  //test validity with a single lookup, so the three mask tests are folded into a copy of the depth image
+  float deepest = 0;
+  #pragma omp for nowait
+  for(int i = 0; i < height; ++i)
+    for(int j = 0; j < width; ++j)
+    {
+      if(validityMask[i][j] && depthImage(j,i) > deepest) deepest = depthImage(j,i);
+      if(fusable != NULL)
+        fusable[size_t(i)*width + j] = (i > 0 && j > 0 && validityMask[i][j] && validityMask[i-1][j] && validityMask[i][j-1]) ?
+                                       depthImage(j,i) : std::numeric_limits<float>::quiet_NaN();
+    }
+
+  #pragma omp critical(max_depth)
+  max_depth = std::max(max_depth, deepest);
+  #pragma omp barrier
+}
+
+template<class V>
+void
+hyperGrid<V>::FuseBrick(int brick, const Eigen::Matrix4d &worldToCam, const cimg_library::CImg<float> &depthImage, bool** validityMask,
+                        const fusion_frame &frame, const float step[3], double min_z)
+{
+  const int BX = active_XSize_/hyperCellSize_;
+  const int BY = active_YSize_/hyperCellSize_;
+  const size_t home = brickIndex(wrap((brick % BX)*hyperCellSize_,0), wrap(((brick / BX) % BY)*hyperCellSize_,1),
+                                 wrap((brick / (BX*BY))*hyperCellSize_,2));
+
+  //each brick is fused by a single thread
+  unsigned char &stable = brickStable_[home];
+  if(freeze_frames_ > 0 && stable >= freeze_frames_)
+  {
+    if(!(FuseRows(brick, worldToCam, depthImage, validityMask, frame, step, min_z, probe_stride_, false) & FUSION_UNSTABLE)) return;
+    stable = 0;
+  }
+
+  const unsigned result = FuseRows(brick, worldToCam, depthImage, validityMask, frame, step, min_z, 1, true);
+  if(result & FUSION_CHANGED) brickDirty_[home] = brickTouched_[home] = 1;
+  if(freeze_frames_ > 0 && (result & FUSION_OBSERVED))
+    stable = (result & FUSION_UNSTABLE) ? 0 : std::min(stable + 1, freeze_frames_);
+}
+
+template<class V>
+template<class P>
+typename std::enable_if<P::has_row_kernel, bool>::type
+hyperGrid<V>::FuseRowKernel(const P &codec, int x0, int y, int z, const Eigen::Matrix4d &worldToCam, const fusion_frame &frame,
+                            const float step[3], bool update, unsigned &result)
+{
+  //block shifts are whole bricks, so the x row of a brick stays contiguous in its slot and is fused in one call
+  Eigen::Vector4d first((x0-active_XSize_/2.0)*cellSize_, (y- active_YSize_/2.0)*cellSize_ , (z- active_ZSize_/2.0)*cellSize_, 1);
+  first = worldToCam*first;
+  const float origin[3] = {float(first(0)), float(first(1)), float(first(2))};
+
+  const int wx = wrap(x0,0); const int wy = wrap(y,1); const int wz = wrap(z,2);
+  const size_t index = brickIndex(wx, wy, wz);
+  int slot = brickTable_[index];
+  if(slot == 0)
+  {
+    const unsigned dry = codec.fuse_row(fusion_isa_, frame, origin, step, NULL, NULL, false);
+    result |= dry;
+    if(!(dry & FUSION_CHANGED) || !update) return true;
+    slot = touchBrick(index);
+    if(slot == 0) return true;
+  }
+  const size_t idx = size_t(slot)*brickVoxels_ + localIndex(wx, wy, wz);
+  result |= codec.fuse_row(fusion_isa_, frame, origin, step, &activeDistance_[idx], &activeWeight_[idx], update);
+  return true;
+}
+
+template<class V>
+unsigned
+hyperGrid<V>::FuseRows(int brick, const Eigen::Matrix4d &worldToCam, const cimg_library::CImg<float> &depthImage, bool** validityMask,
+                       const fusion_frame &frame, const float step[3], double min_z, int stride, bool update)
+{
+  const int BX = active_XSize_/hyperCellSize_;
+  const int BY = active_YSize_/hyperCellSize_;
+  const int bx = brick % BX;
+  const int by = (brick / BX) % BY;
+  const int bz = brick / (BX*BY);
+  unsigned result = 0;
+
+  for(int z = bz*hyperCellSize_; z < (bz+1)*int(hyperCellSize_); z += stride)
+  for(int y = by*hyperCellSize_; y < (by+1)*int(hyperCellSize_); y += stride)
+  {
+    if(fusion_isa_ != FUSION_SCALAR &&
+       FuseRowKernel(codec_, bx*hyperCellSize_, y, z, worldToCam, frame, step, update, result))
+      continue;
+
+    for(int x = bx*hyperCellSize_; x < (bx+1)*int(hyperCellSize_); ++x)
+    {
+      //define a ray and point it into the center of a node
+      Eigen::Vector4d ray((x-active_XSize_/2.0)*cellSize_, (y- active_YSize_/2.0)*cellSize_ , (z- active_ZSize_/2.0)*cellSize_, 1);
+      ray = worldToCam*ray;
+      if(ray(2)-min_z < 0) continue;
 
-        Eigen::Vector2d uv;
-        uv=To2D(ray,fx,fy,cx,cy );
+      Eigen::Vector2d uv;
+      uv=To2D(ray,frame.fx,frame.fy,frame.cx,frame.cy );
 
-        int j=floor(uv(0)+0.5);
-        int i=floor(uv(1)+0.5);
+      int j=floor(uv(0)+0.5);
+      int i=floor(uv(1)+0.5);
 
-        //if the projected coordinate is within image bounds
-        if(i>0 && i<depthImage->height()-1 && j>0 && j <depthImage->width()-1 && validityMask[i][j] &&
-            validityMask[i-1][j] && validityMask[i][j-1])
+      //if the projected coordinate is within image bounds
+      if(i>0 && i<depthImage.height()-1 && j>0 && j <depthImage.width()-1 && validityMask[i][j] &&
+          validityMask[i-1][j] && validityMask[i][j-1])
+      {
+        // const float* Di = *depthImage(j,i);
+        double Eta;
+        // const float W=1/((1+*depthImage(j,i))*(1+*depthImage(j,i)));
+
+        Eta=double(depthImage(j,i))-ray(2);
+
+        if(Eta >= Dmin_)
         {
-          // const float* Di = *depthImage(j,i);
-          double Eta;
-          // const float W=1/((1+*depthImage(j,i))*(1+*depthImage(j,i)));
 
-          Eta=double((*depthImage)(j,i))-ray(2);
+          double D = std::min(Eta,Dmax_);
+
+          float W = ((D - 1e-6) < Dmax_) ? (1.0f) : (frame.Wslope*(D - Dmin_) + 1e-6);
 
-          if(Eta >= Dmin_)
+          const int wx = wrap(x,0); const int wy = wrap(y,1); const int wz = wrap(z,2);
+          const size_t index = brickIndex(wx, wy, wz);
+          int slot = brickTable_[index];
+
+          //free space needs no storage in a sparse volume
+          if(slot == 0)
           {
+            result |= FUSION_OBSERVED | FUSION_UNSTABLE;
+            if(D >= Dmax_) continue;
+            result |= FUSION_CHANGED;
+            if(!update) continue;
+            slot = touchBrick(index);
+            if(slot == 0) continue;
+          }
+          const size_t idx = size_t(slot)*brickVoxels_ + localIndex(wx, wy, wz);
+          const float d = codec_.distance(activeDistance_[idx]);
+          result |= FUSION_OBSERVED;
+          if(!codec_.saturated(activeWeight_[idx]) || std::fabs(float(D) - d) > freeze_tolerance_) result |= FUSION_UNSTABLE;
+
+          distance_t fused = activeDistance_[idx];
+          weight_t fused_w = activeWeight_[idx];
+          codec_.fuse(fused, fused_w, float(D), W);
+          if(fused != activeDistance_[idx]) result |= FUSION_CHANGED;
+          if(update) { activeDistance_[idx] = fused; activeWeight_[idx] = fused_w; }
+
+        }//within visible region
+      }//within bounds
+    }//x
+  }//y,z
+
+  return result;
+}
 
-            double D = std::min(Eta,Dmax_);
+template<class V>
+void
+hyperGrid<V>::FuseBand(const Eigen::Matrix4d &worldToCam, const cimg_library::CImg<float> &depthImage, bool** validityMask,
+                       const fusion_frame &frame, double min_z)
+{
+  const Eigen::Matrix4d camToWorld = worldToCam.inverse();
+  const int size[3] = {int(active_XSize_), int(active_YSize_), int(active_ZSize_)};
+
+  //rays are traced in voxel units, shifted by half a voxel so that voxel v spans [v, v+1)
+  Eigen::Vector3d origin = camToWorld.block<3,1>(0,3)/cellSize_;
+  for(int d = 0; d < 3; ++d) origin(d) += size[d]/2.0 + 0.5;
+
+  //pixels that may be fused, as in FuseBrick
+  const int height = depthImage.height();
+  const int width = depthImage.width();
+  #define FUSABLE(i,j) (validityMask[i][j] && validityMask[(i)-1][j] && validityMask[i][(j)-1])
+
+  //A ray through the center of a block of s x s pixels passes within s/sqrt(2) pixels of every voxel that projects
+  //into the block. While that is under half a voxel at the depth of the voxel, the ray crosses it, so one ray per
+  //block visits all of the block's voxels. s is chosen per tile of 8 x 8 pixels from the deepest voxel of its band
+  const int tile = 8;
+  const double focal = std::min(frame.fx, frame.fy);
+
+  #pragma omp parallel for schedule(dynamic)
+  for(int ti = 1; ti < height-1; ti += tile)
+  for(int tj = 1; tj < width-1; tj += tile)
+  {
+    double deepest = 0;
+    for(int i = ti; i < std::min(ti+tile, height-1); ++i)
+      for(int j = tj; j < std::min(tj+tile, width-1); ++j)
+        if(FUSABLE(i,j)) deepest = std::max(deepest, double(depthImage(j,i)));
+    if(deepest == 0) continue;
 
-            float W = ((D - 1e-6) < Dmax_) ? (1.0f) : (Wslope*(D - Dmin_) + 1e-6);
+    int s = tile;
+    while(s > 1 && s*M_SQRT2*(deepest - Dmin_ + cellSize_) >= focal*cellSize_) s /= 2;
 
-            activeVolume(x, y, z*2) = (activeVolume(x, y, z*2)* activeVolume(x, y, 1+z*2) + float(D) * W) /
-                      (activeVolume(x, y, 1+z*2) + W);
-            activeVolume(x, y, 1+z*2) = std::min(activeVolume(x, y, 1+z*2) + W , float(Wmax_));
+    for(int bi = ti; bi < std::min(ti+tile, height-1); bi += s)
+    for(int bj = tj; bj < std::min(tj+tile, width-1); bj += s)
+    {
+      const int i_end = std::min(bi+s, height-1);
+      const int j_end = std::min(bj+s, width-1);
 
-          }//within visible region
-        }//within bounds
-      }//z
-    }//y
-  }//x
-  return;
-};
+      double near = std::numeric_limits<double>::max(), far = 0;
+      for(int i = bi; i < i_end; ++i)
+        for(int j = bj; j < j_end; ++j)
+          if(FUSABLE(i,j))
+          {
+            near = std::min(near, double(depthImage(j,i)));
+            far = std::max(far, double(depthImage(j,i)));
+          }
+      if(far == 0) continue;
 
+      //the point at camera depth t lies at origin + t*dir. A voxel center can be up to half a diagonal away from
+      //where the ray crosses the voxel, so the band is widened by a voxel at each end
+      const Eigen::Vector3d dir = camToWorld.block<3,3>(0,0)*Eigen::Vector3d((0.5*(bj + j_end - 1) - frame.cx)/frame.fx,
+                                                                              (0.5*(bi + i_end - 1) - frame.cy)/frame.fy, 1.0)/cellSize_;
+      double t0 = std::max(near - Dmax_ - cellSize_, 0.0);
+      double t1 = far - Dmin_ + cellSize_;
 
-double
-hyperGrid::SDF(const Eigen::Vector4d &location)
-{
-  double i,j,k;
-  double x,y,z;
+      //clip to the active volume
+      for(int d = 0; d < 3; ++d)
+      {
+        if(dir(d) == 0)
+        {
+          if(origin(d) < 0 || origin(d) >= size[d]) t1 = -1;
+          continue;
+        }
+        double ta = -origin(d)/dir(d), tb = (size[d] - origin(d))/dir(d);
+        if(ta > tb) std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+      }
+      if(t0 >= t1) continue;
 
-  if(std::isnan(location(0)+location(1)+location(2))) return Dmax_;
+      //Amanatides and Woo traversal of the voxels the ray crosses between t0 and t1
+      int voxel[3], step[3];
+      double t_next[3], t_delta[3];
+      for(int d = 0; d < 3; ++d)
+      {
+        const double start = origin(d) + t0*dir(d);
+        voxel[d] = std::min(std::max(int(floor(start)), 0), size[d]-1);
+        step[d] = (dir(d) > 0) ? 1 : -1;
+        t_delta[d] = (dir(d) != 0) ? std::abs(1.0/dir(d)) : std::numeric_limits<double>::max();
+        t_next[d] = (dir(d) != 0) ? t0 + ((dir(d) > 0) ? (voxel[d] + 1 - start) : (start - voxel[d]))*t_delta[d]
+                                  : std::numeric_limits<double>::max();
+      }
+
+      for(double t = t0; t <= t1; )
+      {
+        //each voxel is fused once, by the block it projects into, from its own pixel exactly as in FuseBrick
+        Eigen::Vector4d ray((voxel[0]-active_XSize_/2.0)*cellSize_, (voxel[1]-active_YSize_/2.0)*cellSize_,
+                            (voxel[2]-active_ZSize_/2.0)*cellSize_, 1);
+        ray = worldToCam*ray;
+        if(ray(2)-min_z >= 0)
+        {
+          Eigen::Vector2d uv = To2D(ray, frame.fx, frame.fy, frame.cx, frame.cy);
+          const int j = floor(uv(0)+0.5);
+          const int i = floor(uv(1)+0.5);
+          if(i >= bi && i < i_end && j >= bj && j < j_end && FUSABLE(i,j))
+          {
+            const double Eta = double(depthImage(j,i)) - ray(2);
+            if(Eta >= Dmin_ && Eta < Dmax_)
+            {
+              const int wx = wrap(voxel[0],0); const int wy = wrap(voxel[1],1); const int wz = wrap(voxel[2],2);
+              const size_t brick = brickIndex(wx, wy, wz);
+              const int slot = (brickTable_[brick] != 0) ? brickTable_[brick] : touchBrick(brick);
+              if(slot != 0)
+              {
+                const size_t idx = size_t(slot)*brickVoxels_ + localIndex(wx, wy, wz);
+                const distance_t before = activeDistance_[idx];
+                codec_.fuse(activeDistance_[idx], activeWeight_[idx], float(Eta), 1.0f);
+                if(activeDistance_[idx] != before)
+                {
+                  #pragma omp atomic write
+                  brickDirty_[brick] = 1;
+                  #pragma omp atomic write
+                  brickTouched_[brick] = 1;
+                }
+              }
+            }
+          }
+        }
 
-  x = modf((location(0)/cellSize_)/hyperCellSize_ + hyper_XSize_/2.0, &i);
-  y = modf((location(1)/cellSize_)/hyperCellSize_ + hyper_YSize_/2.0, &j);
-  z = modf((location(2)/cellSize_)/hyperCellSize_ + hyper_ZSize_/2.0, &k);
+        const int d = (t_next[0] < t_next[1]) ? ((t_next[0] < t_next[2]) ? 0 : 2) : ((t_next[1] < t_next[2]) ? 1 : 2);
+        t = t_next[d];
+        voxel[d] += step[d];
+        if(voxel[d] < 0 || voxel[d] >= size[d]) break;
+        t_next[d] += t_delta[d];
+      }
+    }
+  }
+  #undef FUSABLE
+}
 
-  if(i>=hyper_XSize_-1 || j>=hyper_YSize_-1 || k>=hyper_ZSize_-1 || i<0 || j<0 || k<0)return Dmax_;
+template<class V>
+void
+hyperGrid<V>::CullBricks(const Eigen::Matrix4d &worldToCam, double min_z, double max_z, int width, int height, float fx, float fy, float cx, float cy)
+{
+  //a voxel is fused if its depth is at least min_z and at most max_z, and if it projects to a pixel in
+  //[1,width-2]x[1,height-2]. Depth is affine in position, so its range over a brick is found at the corners. As long
+  //as all corners are in front of the camera, the brick projects into the bounding box of its projected corners.
+  //The margins keep the test conservative against rounding
+  const double z_margin = cellSize_;
+  const double uv_margin = 1.0;
+  const int last = hyperCellSize_-1;
+
+  const int BX = active_XSize_/hyperCellSize_;
+  const int BY = active_YSize_/hyperCellSize_;
+  const int BZ = active_ZSize_/hyperCellSize_;
+
+  #pragma omp for
+  for(int b = 0; b < BX*BY*BZ; ++b)
+  {
+    const int bx = b % BX;
+    const int by = (b / BX) % BY;
+    const int bz = b / (BX*BY);
 
-  int I = int(i); int J = int(j); int K = int(k);
+    double z_lo = std::numeric_limits<double>::max(), z_hi = -std::numeric_limits<double>::max();
+    double u_lo = z_lo, u_hi = z_hi, v_lo = z_lo, v_hi = z_hi;
+    bool in_front = true;
 
-  x = modf(location(0)/cellSize_ + active_XSize_/2.0, &i);
-  y = modf(location(1)/cellSize_ + active_YSize_/2.0, &j);
-  z = modf(location(2)/cellSize_ + active_ZSize_/2.0, &k);
+    for(int c = 0; c < 8; ++c)
+    {
+      Eigen::Vector4d corner(((bx*hyperCellSize_ + ((c&1) ? last : 0)) - active_XSize_/2.0)*cellSize_,
+                             ((by*hyperCellSize_ + ((c&2) ? last : 0)) - active_YSize_/2.0)*cellSize_,
+                             ((bz*hyperCellSize_ + ((c&4) ? last : 0)) - active_ZSize_/2.0)*cellSize_, 1);
+      corner = worldToCam*corner;
+      z_lo = std::min(z_lo, corner(2));
+      z_hi = std::max(z_hi, corner(2));
+
+      if(corner(2) <= 0) { in_front = false; continue; }
+      Eigen::Vector2d uv = To2D(corner, fx, fy, cx, cy);
+      u_lo = std::min(u_lo, uv(0)); u_hi = std::max(u_hi, uv(0));
+      v_lo = std::min(v_lo, uv(1)); v_hi = std::max(v_hi, uv(1));
+    }
 
-  if(i>=0 + active_XSize_-1 ||
-     j>=0 + active_YSize_-1 ||
-     k>=0 + active_ZSize_-1 ||
-     i <0 ||
-     j <0 ||
-     k <0)return Dmax_;
+    brickVisible_[b] = !(z_hi < min_z - z_margin || z_lo > max_z + z_margin ||
+                         (in_front && (u_hi < 0.5 - uv_margin || u_lo >= width - 1.5 + uv_margin ||
+                                       v_hi < 0.5 - uv_margin || v_lo >= height - 1.5 + uv_margin)));
+  }
 
+  //listed in Morton order, so that any run of visibleBricks_ is a compact tile of the volume
+  #pragma omp single
+  {
+    visibleBricks_.clear();
+    for(size_t m = 0; m < mortonBricks_.size(); ++m)
+      if(brickVisible_[mortonBricks_[m]]) visibleBricks_.push_back(mortonBricks_[m]);
+  }
+}
 
-  I = int(i); J = int(j); K = int(k);
+template<class V>
+int hyperGrid<V>::visibleBricks(void)
+{
+  return int(visibleBricks_.size());
+}
+
+template<class V>
+int hyperGrid<V>::frozenBricks(void)
+{
+  int frozen = 0;
+  for(size_t b = 0; b < brickStable_.size(); ++b)
+    if(freeze_frames_ > 0 && brickStable_[b] >= freeze_frames_) ++frozen;
+  return frozen;
+}
 
-  float N1 = activeVolume(I,    J,    K*2); float N1_1 = activeVolume(I,    J,    K*2+2);
-  float N2 = activeVolume(I,    J+1,  K*2); float N2_1 = activeVolume(I,    J+1,  K*2+2);
-  float N3 = activeVolume(I+1,  J,    K*2); float N3_1 = activeVolume(I+1,  J,    K*2+2);
-  float N4 = activeVolume(I+1,  J+1,  K*2); float N4_1 = activeVolume(I+1,  J+1,  K*2+2);
+
+template<class V>
+double
+hyperGrid<V>::SDF(const Eigen::Vector4d &location)
+{
+  //the active volume lies inside the hyper grid, so its own bounds are the only ones to check.
+  //the comparisons are written so that NaN locations also fail them
+  const double fi = location(0)/cellSize_ + active_XSize_/2.0;
+  const double fj = location(1)/cellSize_ + active_YSize_/2.0;
+  const double fk = location(2)/cellSize_ + active_ZSize_/2.0;
+
+  if(!(fi >= 0 && fi < active_XSize_-1 &&
+       fj >= 0 && fj < active_YSize_-1 &&
+       fk >= 0 && fk < active_ZSize_-1)) return Dmax_;
+
+  const int I = int(fi); const int J = int(fj); const int K = int(fk);
+  const double x = fi-I; const double y = fj-J; const double z = fk-K;
+
+  float N1, N1_1, N2, N2_1, N3, N3_1, N4, N4_1;
+  const distance_t* N = stencil(I, J, K, 2);
+  if(N != NULL)
+  {
+    N1 = codec_.distance(N[0]);                    N1_1 = codec_.distance(N[stride_z_]);
+    N2 = codec_.distance(N[stride_y_]);            N2_1 = codec_.distance(N[stride_y_+stride_z_]);
+    N3 = codec_.distance(N[stride_x_]);            N3_1 = codec_.distance(N[stride_x_+stride_z_]);
+    N4 = codec_.distance(N[stride_x_+stride_y_]);  N4_1 = codec_.distance(N[stride_x_+stride_y_+stride_z_]);
+  }
+  else
+  {
+    N1 = activeVolume(I,    J,    K); N1_1 = activeVolume(I,    J,    K+1);
+    N2 = activeVolume(I,    J+1,  K); N2_1 = activeVolume(I,    J+1,  K+1);
+    N3 = activeVolume(I+1,  J,    K); N3_1 = activeVolume(I+1,  J,    K+1);
+    N4 = activeVolume(I+1,  J+1,  K); N4_1 = activeVolume(I+1,  J+1,  K+1);
+  }
 
   double a1,a2,b1,b2;
   a1 = double(N1*(1-z)+N1_1*z);
@@ -1260,34 +2155,33 @@ hyperGrid::SDF(const Eigen::Vector4d &location)
 };
 
 
+template<class V>
 double
-hyperGrid::SDF_R(const Eigen::Vector4d &location)
+hyperGrid<V>::SDF_R(const Eigen::Vector4d &location)
 {
-  double i,j,k;
-  double x,xh,y,yh,z,zh;
+  double x,y,z;
 
   if(std::isnan(location(0)+location(1)+location(2))) return Dmax_;
 
-  xh = modf((location(0)/cellSize_)/hyperCellSize_ + hyper_XSize_/2.0, &i);
-  yh = modf((location(1)/cellSize_)/hyperCellSize_ + hyper_YSize_/2.0, &j);
-  zh = modf((location(2)/cellSize_)/hyperCellSize_ + hyper_ZSize_/2.0, &k);
-
-  if(i>=hyper_XSize_-1 || j>=hyper_YSize_-1 || k>=hyper_ZSize_-1 || i<0 || j<0 || k<0)return Dmax_;
-
-  int I = int(i); int J = int(j); int K = int(k);
+  const double fi = location(0)/cellSize_ + active_XSize_/2.0;
+  const double fj = location(1)/cellSize_ + active_YSize_/2.0;
+  const double fk = location(2)/cellSize_ + active_ZSize_/2.0;
 
-  x = modf(location(0)/cellSize_ + active_XSize_/2.0, &i);
-  y = modf(location(1)/cellSize_ + active_YSize_/2.0, &j);
-  z = modf(location(2)/cellSize_ + active_ZSize_/2.0, &k);
-
-  if(i>=0 + active_XSize_-1 ||
-     j>=0 + active_YSize_-1 ||
-     k>=0 + active_ZSize_-1 ||
-     i <0 ||
-     j <0 ||
-     k <0)
+  if(!(fi >= 0 && fi < active_XSize_-1 &&
+       fj >= 0 && fj < active_YSize_-1 &&
+       fk >= 0 && fk < active_ZSize_-1))
     {
-      if (hGrid_[I][J][K].descriptor.size() > 0)
+      //the last voxel of each axis still lies in an active brick, whose cell may hold a stale descriptor
+      const int bi = int(floor(fi/hyperCellSize_));
+      const int bj = int(floor(fj/hyperCellSize_));
+      const int bk = int(floor(fk/hyperCellSize_));
+      if(bi >= 0 && bi < int(active_XSize_/hyperCellSize_) && bj >= 0 && bj < int(active_YSize_/hyperCellSize_) &&
+         bk >= 0 && bk < int(active_ZSize_/hyperCellSize_)) return Dmax_;
+
+      gridCell* cell = hGrid_.find(bi + active_offset_[0] + block_shift_[0],
+                                   bj + active_offset_[1] + block_shift_[1],
+                                   bk + active_offset_[2] + block_shift_[2]);
+      if (cell != NULL && descriptors_.stored(*cell))
       {
         return -0.0001;
       }
@@ -1295,12 +2189,25 @@ hyperGrid::SDF_R(const Eigen::Vector4d &location)
     }
 
 
-  I = int(i); J = int(j); K = int(k);
+  const int I = int(fi); const int J = int(fj); const int K = int(fk);
+  x = fi-I; y = fj-J; z = fk-K;
 
-  float N1 = activeVolume(I,    J,    K*2); float N1_1 = activeVolume(I,    J,    K*2+2);
-  float N2 = activeVolume(I,    J+1,  K*2); float N2_1 = activeVolume(I,    J+1,  K*2+2);
-  float N3 = activeVolume(I+1,  J,    K*2); float N3_1 = activeVolume(I+1,  J,    K*2+2);
-  float N4 = activeVolume(I+1,  J+1,  K*2); float N4_1 = activeVolume(I+1,  J+1,  K*2+2);
+  float N1, N1_1, N2, N2_1, N3, N3_1, N4, N4_1;
+  const distance_t* N = stencil(I, J, K, 2);
+  if(N != NULL)
+  {
+    N1 = codec_.distance(N[0]);                    N1_1 = codec_.distance(N[stride_z_]);
+    N2 = codec_.distance(N[stride_y_]);            N2_1 = codec_.distance(N[stride_y_+stride_z_]);
+    N3 = codec_.distance(N[stride_x_]);            N3_1 = codec_.distance(N[stride_x_+stride_z_]);
+    N4 = codec_.distance(N[stride_x_+stride_y_]);  N4_1 = codec_.distance(N[stride_x_+stride_y_+stride_z_]);
+  }
+  else
+  {
+    N1 = activeVolume(I,    J,    K); N1_1 = activeVolume(I,    J,    K+1);
+    N2 = activeVolume(I,    J+1,  K); N2_1 = activeVolume(I,    J+1,  K+1);
+    N3 = activeVolume(I+1,  J,    K); N3_1 = activeVolume(I+1,  J,    K+1);
+    N4 = activeVolume(I+1,  J+1,  K); N4_1 = activeVolume(I+1,  J+1,  K+1);
+  }
 
   double a1,a2,b1,b2;
   a1 = double(N1*(1-z)+N1_1*z);
@@ -1311,8 +2218,9 @@ hyperGrid::SDF_R(const Eigen::Vector4d &location)
   return double((a1*(1-y)+a2*y)*(1-x) + (b1*(1-y)+b2*y)*x);
 };
 
+template<class V>
 double
-hyperGrid::SDFGradient_R(const Eigen::Vector4d &location, int stepSize, int dim )
+hyperGrid<V>::SDFGradient_R(const Eigen::Vector4d &location, int stepSize, int dim )
 {
   double c[3] = {1.0,0.0,0.0};
   if(SDF_R(location) < -1.0) return (c[dim]);
@@ -1325,18 +2233,122 @@ hyperGrid::SDFGradient_R(const Eigen::Vector4d &location, int stepSize, int dim
 };
 
 
-float& hyperGrid::activeVolume(int x, int y, int z)
+template<class V>
+size_t hyperGrid<V>::activeBrick(int i, int j, int k)
 {
-  int idx_x = mod(x + block_shift_[0]*hyperCellSize_, active_XSize_);
-  int idx_y = mod(y + block_shift_[1]*hyperCellSize_, active_YSize_);
-  int idx_z = mod(z + 2*block_shift_[2]*hyperCellSize_, active_ZSize_*2);
-  return activeVolume_[idx_x][idx_y][idx_z];
+  const int BX = active_XSize_/hyperCellSize_;
+  const int BY = active_YSize_/hyperCellSize_;
+  const int BZ = active_ZSize_/hyperCellSize_;
+  return (size_t(mod(k + block_shift_[2], BZ))*BY + mod(j + block_shift_[1], BY))*BX + mod(i + block_shift_[0], BX);
 }
 
-float& hyperGrid::activeVolume_w(int x, int y, int z)
+template<class V>
+inline size_t hyperGrid<V>::brickIndex(int x, int y, int z)
 {
-  int idx_x = mod(x + block_shift_[0]*hyperCellSize_, active_XSize_);
-  int idx_y = mod(y + block_shift_[1]*hyperCellSize_, active_YSize_);
-  int idx_z = mod(z + 2*block_shift_[2]*hyperCellSize_, active_ZSize_*2);
-  return activeVolume_[idx_x][idx_y][idx_z +1];
+  const int BX = active_XSize_/hyperCellSize_;
+  const int BY = active_YSize_/hyperCellSize_;
+  const uint ux = x, uy = y, uz = z;
+  return (size_t(uz/hyperCellSize_)*BY + uy/hyperCellSize_)*BX + ux/hyperCellSize_;
 }
+
+template<class V>
+inline size_t hyperGrid<V>::localIndex(int x, int y, int z)
+{
+  const uint ux = x, uy = y, uz = z;
+  return (size_t(uz%hyperCellSize_)*hyperCellSize_ + uy%hyperCellSize_)*hyperCellSize_ + ux%hyperCellSize_;
+}
+
+template<class V>
+size_t hyperGrid<V>::voxelOffset(int x, int y, int z)
+{
+  return size_t(brickTable_[brickIndex(x, y, z)])*brickVoxels_ + localIndex(x, y, z);
+}
+
+template<class V>
+int hyperGrid<V>::allocateBrick(void)
+{
+  if(freeBricks_.empty()) return 0;
+  int slot = freeBricks_.back();
+  freeBricks_.pop_back();
+
+  distance_t* brick_d = activeDistance_ + size_t(slot)*brickVoxels_;
+  weight_t* brick_w = activeWeight_ + size_t(slot)*brickVoxels_;
+  for (size_t idx = 0; idx < brickVoxels_; ++idx)
+    codec_.set(brick_d[idx], brick_w[idx], Dmax_, 0.0f);
+  return slot;
+}
+
+template<class V>
+void hyperGrid<V>::releaseBrick(int slot)
+{
+  freeBricks_.push_back(slot);
+}
+
+template<class V>
+int hyperGrid<V>::touchBrick(size_t brick)
+{
+  int slot;
+  #pragma omp critical(brick_pool)
+  {
+    slot = brickTable_[brick];
+    if(slot == 0)
+    {
+      slot = allocateBrick();
+      brickTable_[brick] = slot;
+    }
+  }
+  return slot;
+}
+
+template<class V>
+int hyperGrid<V>::allocatedBricks(void)
+{
+  const int num_bricks = (active_XSize_/hyperCellSize_)*(active_YSize_/hyperCellSize_)*(active_ZSize_/hyperCellSize_);
+  return num_bricks - int(freeBricks_.size());
+}
+
+template<class V>
+void hyperGrid<V>::updateRing(void)
+{
+  const int sizes[3] = {int(active_XSize_), int(active_YSize_), int(active_ZSize_)};
+  ring_pow2_ = true;
+  for (int d = 0; d < 3; ++d)
+  {
+    ring_shift_[d] = mod(block_shift_[d]*int(hyperCellSize_), sizes[d]);
+    ring_mask_[d] = sizes[d]-1;
+    ring_pow2_ = ring_pow2_ && ((sizes[d] & (sizes[d]-1)) == 0);
+  }
+}
+
+template<class V>
+inline int hyperGrid<V>::wrap(int v, int dim)
+{
+  if(ring_pow2_) return (v + ring_shift_[dim]) & ring_mask_[dim];
+  return mod(v + ring_shift_[dim], ring_mask_[dim]+1);
+}
+
+template<class V>
+const typename hyperGrid<V>::distance_t* hyperGrid<V>::stencil(int I, int J, int K, int extent)
+{
+  int x = wrap(I,0); int y = wrap(J,1); int z = wrap(K,2);
+  //the ring seam always falls between bricks, so staying inside a brick also means no wrap-around
+  if( (x%hyperCellSize_) + extent > hyperCellSize_ ||
+      (y%hyperCellSize_) + extent > hyperCellSize_ ||
+      (z%hyperCellSize_) + extent > hyperCellSize_ ) return NULL;
+  return activeDistance_ + voxelOffset(x, y, z);
+}
+
+template<class V>
+float hyperGrid<V>::activeVolume(int x, int y, int z)
+{
+  return codec_.distance(activeDistance_[voxelOffset(wrap(x,0), wrap(y,1), wrap(z,2))]);
+}
+
+template<class V>
+float hyperGrid<V>::activeVolume_w(int x, int y, int z)
+{
+  return codec_.weight(activeWeight_[voxelOffset(wrap(x,0), wrap(y,1), wrap(z,2))]);
+}
+
+template class hyperGrid<float_voxel>;
+template class hyperGrid<quantized_voxel>;